@@ -6,9 +6,15 @@
 
 #include "OptionParser.h"
 
+#include <FEXCore/fextl/memory.h>
+#include <FEXCore/fextl/unordered_map.h>
+
 #include <cstdlib>
 #include <algorithm>
 #include <complex>
+#include <cstdint>
+#include <cstring>
+#include <thread>
 #include <ciso646>
 #include <optional>
 
@@ -19,6 +25,23 @@
 # define _(s) ((const char *) (s))
 #endif
 
+#if defined(OPTPARSE_TRACE) && OPTPARSE_TRACE
+# include <atomic>
+# include <chrono>
+# include <cstdio>
+# define TRACE_SCOPE(name, phase) trace::Scope name(trace::phase)
+# define TRACE_END(name) name.end()
+#else
+# define TRACE_SCOPE(name, phase)
+# define TRACE_END(name)
+#endif
+
+#ifdef _WIN32
+# define environ _environ
+#else
+extern char** environ;
+#endif
+
 namespace optparse {
 
 ////////// auxiliary (string) functions { //////////
@@ -43,55 +66,84 @@ template<class InputIterator>
 static fextl::string str_join(const fextl::string& sep, InputIterator begin, InputIterator end) {
   return str_join_trans(sep, begin, end, str_wrap(""));
 }
-static fextl::string& str_replace(fextl::string& s, const fextl::string& patt, const fextl::string& repl) {
+static fextl::string str_replace(const fextl::string& s, const fextl::string& patt, const fextl::string& repl) {
+  fextl::string tmp;
+  tmp.reserve(s.size());
   size_t pos = 0, n = patt.length();
   while (true) {
-    pos = s.find(patt, pos);
-    if (pos == fextl::string::npos)
+    size_t hit = s.find(patt, pos);
+    if (hit == fextl::string::npos)
       break;
-    s.replace(pos, n, repl);
-    pos += repl.size();
+    tmp.append(s, pos, hit - pos);
+    tmp += repl;
+    pos = hit + n;
   }
-  return s;
-}
-static fextl::string str_replace(const fextl::string& s, const fextl::string& patt, const fextl::string& repl) {
-  fextl::string tmp = s;
-  str_replace(tmp, patt, repl);
+  tmp.append(s, pos, fextl::string::npos);
   return tmp;
 }
-static fextl::string str_format(const fextl::string& str, size_t pre, size_t len, bool running_text = true, bool indent_first = true) {
-  fextl::string s = str;
-  fextl::stringstream ss;
-  fextl::string p;
-  len -= 2; // Python seems to not use full length
-  if (running_text)
-    replace(s.begin(), s.end(), '\n', ' ');
-  if (indent_first)
-    p = fextl::string(pre, ' ');
-
-  size_t pos = 0, linestart = 0;
-  size_t line = 0;
-  while (true) {
-    bool wrap = false;
-
-    size_t new_pos = s.find_first_of(" \n\t", pos);
-    if (new_pos == fextl::string::npos)
-      break;
-    if (s[new_pos] == '\n') {
-      pos = new_pos + 1;
-      wrap = true;
+//! Word wrapping in a single pass, appending to the output buffer as it goes
+class str_wrapper {
+public:
+  str_wrapper(fextl::string& out, size_t pre, size_t len, bool running_text, bool indent_first) :
+    _out(out), _pre(pre), _len(len - 2), // Python seems to not use full length
+    _running_text(running_text) {
+    if (indent_first)
+      _out.append(_pre, ' ');
+    _line = _seg = _out.size();
+  }
+  void put(char c) {
+    if (c == '\n' and _running_text)
+      c = ' ';
+    if (c != ' ' and c != '\n' and c != '\t') {
+      _out += c;
+      return;
+    }
+    if (c == '\n') {
+      newline();
+      return;
     }
-    if (line == 1)
-      p = fextl::string(pre, ' ');
-    if (wrap || new_pos + pre > linestart + len) {
-      ss << p << s.substr(linestart, pos - linestart - 1) << std::endl;
-      linestart = pos;
-      line++;
+    if (_out.size() - _line + _pre > _len) {
+      if (_seg == _line) {
+        // a single word longer than the line gets a line of its own
+        newline();
+        return;
+      }
+      // move the current word to a new line, replacing the blank before it
+      _out.insert(_seg, _pre, ' ');
+      _out[_seg - 1] = '\n';
+      _line = _seg + _pre;
     }
-    pos = new_pos + 1;
+    _out += c;
+    _seg = _out.size();
   }
-  ss << p << s.substr(linestart) << std::endl;
-  return ss.str();
+  void finish() { _out += '\n'; }
+
+private:
+  void newline() {
+    _out += '\n';
+    _out.append(_pre, ' ');
+    _line = _seg = _out.size();
+  }
+
+  fextl::string& _out;
+  const size_t _pre, _len;
+  const bool _running_text;
+  size_t _line, _seg;
+};
+//! Appends str wrapped to len columns and indented by pre, substituting patt by repl on the way
+static void str_format(fextl::string& out, const fextl::string& str, size_t pre, size_t len,
+                       bool running_text = true, bool indent_first = true,
+                       const fextl::string& patt = "", const fextl::string& repl = "") {
+  str_wrapper w(out, pre, len, running_text, indent_first);
+  for (size_t i = 0; i < str.length(); ) {
+    if (patt != "" and str[i] == patt[0] and str.compare(i, patt.length(), patt) == 0) {
+      for (size_t j = 0; j < repl.length(); ++j)
+        w.put(repl[j]);
+      i += patt.length();
+    } else
+      w.put(str[i++]);
+  }
+  w.finish();
 }
 static fextl::string str_inc(const fextl::string& s) {
   fextl::stringstream ss;
@@ -101,6 +153,106 @@ static fextl::string str_inc(const fextl::string& s) {
   ss << i+1;
   return ss.str();
 }
+//! Levenshtein distance of one pattern to many strings, bit-parallel after Myers (Hyyrö's variant)
+class str_distance {
+public:
+  str_distance(const fextl::string& p) : _p(p), _peq() {
+    if (p.length() <= 64) {
+      for (size_t i = 0; i < p.length(); ++i)
+        _peq[static_cast<unsigned char>(p[i])] |= uint64_t(1) << i;
+    }
+  }
+  //! Distance to t, or max+1 as soon as it is known to exceed max
+  size_t operator() (const fextl::string& t, size_t max) const {
+    const size_t m = _p.length(), n = t.length();
+    if ((m > n ? m - n : n - m) > max)
+      return max + 1;
+    if (m == 0)
+      return n;
+    if (m > 64)
+      return banded(t, max);
+
+    // one bit per pattern character for the +1/-1 vertical deltas of the
+    // current column; the score tracks the last row
+    const uint64_t last = uint64_t(1) << (m - 1);
+    uint64_t pv = ~uint64_t(0), mv = 0;
+    size_t score = m;
+    for (size_t j = 0; j < n; ++j) {
+      const uint64_t eq = _peq[static_cast<unsigned char>(t[j])];
+      const uint64_t xv = eq | mv;
+      const uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+      uint64_t ph = mv | ~(xh | pv);
+      uint64_t mh = pv & xh;
+      if (ph & last)
+        ++score;
+      else if (mh & last)
+        --score;
+      // the score drops by at most one per remaining character
+      if (score > max + (n - j - 1))
+        return max + 1;
+      ph = (ph << 1) | 1;
+      mh <<= 1;
+      pv = mh | ~(xv | ph);
+      mv = ph & xv;
+    }
+    return score;
+  }
+
+private:
+  //! Plain dynamic programming restricted to the diagonal band, for patterns over 64 characters
+  size_t banded(const fextl::string& t, size_t max) const {
+    const size_t m = _p.length(), n = t.length(), inf = max + 1;
+    fextl::vector<size_t> prev(n + 1, inf), cur(n + 1, inf);
+    for (size_t j = 0; j <= std::min(n, max); ++j)
+      prev[j] = j;
+    for (size_t i = 1; i <= m; ++i) {
+      const size_t lo = (i > max) ? i - max : 0, hi = std::min(n, i + max);
+      size_t best = inf;
+      std::fill(cur.begin(), cur.end(), inf);
+      if (lo == 0)
+        cur[0] = i;
+      for (size_t j = std::max<size_t>(lo, 1); j <= hi; ++j) {
+        size_t d = prev[j-1] + (_p[i-1] == t[j-1] ? 0 : 1);
+        d = std::min(d, std::min(prev[j], cur[j-1]) + 1);
+        cur[j] = std::min(d, inf);
+        best = std::min(best, cur[j]);
+      }
+      if (lo == 0)
+        best = std::min(best, cur[0]);
+      if (best > max)
+        return inf;
+      prev.swap(cur);
+    }
+    return std::min(prev[n], inf);
+  }
+
+  const fextl::string _p;
+  uint64_t _peq[256];
+};
+//! ", did you mean X?" naming the closest candidates to word, or "" if none is close
+template<typename InputIterator>
+static fextl::string str_suggest(const fextl::string& word, InputIterator begin, InputIterator end, str_wrap wrap) {
+  const size_t max = std::min<size_t>(3, std::max<size_t>(1, word.length() / 3));
+  const str_distance distance(word);
+  fextl::vector<fextl::string> best;
+  size_t best_d = max + 1;
+  for (InputIterator it = begin; it != end; ++it) {
+    // ties with the best so far are still of interest
+    size_t d = distance(*it, best_d == max + 1 ? max : best_d);
+    if (d > max or d > best_d)
+      continue;
+    if (d < best_d) {
+      best.clear();
+      best_d = d;
+    }
+    // the same name twice, e.g. a duplicate choice, is suggested once
+    if (best.size() < 3 and std::find(best.begin(), best.end(), *it) == best.end())
+      best.push_back(*it);
+  }
+  if (best.empty())
+    return "";
+  return fextl::string(", ") + _("did you mean") + " " + str_join_trans(" or ", best.begin(), best.end(), wrap) + "?";
+}
 static unsigned int cols() {
   unsigned int n = 80;
 #ifndef _WIN32
@@ -141,6 +293,7 @@ Option& OptionContainer::add_option(const fextl::string& opt1, const fextl::stri
   return add_option(fextl::vector<fextl::string>(&tmp[0], &tmp[3]));
 }
 Option& OptionContainer::add_option(const fextl::vector<fextl::string>& v) {
+  TRACE_SCOPE(t, REGISTRATION);
   _opts.resize(_opts.size()+1, Option(get_parser()));
   Option& option = _opts.back();
   fextl::string dest_fallback;
@@ -164,17 +317,15 @@ Option& OptionContainer::add_option(const fextl::vector<fextl::string>& v) {
   return option;
 }
 fextl::string OptionContainer::format_option_help(unsigned int indent /* = 2 */) const {
-  fextl::stringstream ss;
-
-  if (_opts.empty())
-    return ss.str();
-
+  fextl::string out;
+  format_option_help(out, indent);
+  return out;
+}
+void OptionContainer::format_option_help(fextl::string& out, unsigned int indent) const {
   for (fextl::list<Option>::const_iterator it = _opts.begin(); it != _opts.end(); ++it) {
     if (it->help() != SUPPRESS_HELP)
-      ss << it->format_help(indent);
+      it->format_help(out, indent);
   }
-
-  return ss.str();
 }
 ////////// } class OptionContainer //////////
 
@@ -184,9 +335,81 @@ OptionParser::OptionParser() :
   _usage(_("%prog [options]")),
   _add_help_option(true),
   _add_version_option(true),
-  _interspersed_args(true) {}
+  _interspersed_args(true),
+  _argv(0),
+  _arg_count(0),
+  _source(0),
+  _keep_args(true),
+  _parent(0),
+  _executor(0),
+  _callback_threads(4) {
+  std::fill(_short_table, _short_table + 256, static_cast<Option const*>(0));
+}
 
-OptionParser& OptionParser::add_option_group(const OptionGroup& group) {
+void OptionParser::build_lookup_tables() {
+  // options of owned groups may have been added after the group
+  for (fextl::list<OptionGroup>::const_iterator it = _owned_groups.begin(); it != _owned_groups.end(); ++it)
+    index_group(*it);
+
+  // the maps are sorted, so the name array is too
+  _long_names.clear();
+  _long_table.clear();
+  _long_names.reserve(_optmap_l.size());
+  _long_table.reserve(_optmap_l.size());
+  for (optMap::const_iterator it = _optmap_l.begin(); it != _optmap_l.end(); ++it) {
+    _long_names.push_back(it->first);
+    _long_table.push_back(it->second);
+  }
+  _neg_names.clear();
+  _neg_table.clear();
+  for (optMap::const_iterator it = _optmap_l.begin(); it != _optmap_l.end(); ++it) {
+    if (it->second->_action_kind == Option::ACTION_STORE_BOOL) {
+      _neg_names.push_back(it->first);
+      _neg_table.push_back(it->second);
+    }
+  }
+
+  _dest_options.clear();
+  fextl::set<fextl::string> seen;
+  for (fextl::list<Option>::const_iterator it = _opts.begin(); it != _opts.end(); ++it) {
+    if (it->_action_kind != Option::ACTION_HELP and it->_action_kind != Option::ACTION_VERSION and
+        it->dest() != "" and seen.insert(it->dest()).second)
+      _dest_options.push_back(&*it);
+  }
+  for (fextl::list<OptionGroup const*>::const_iterator group_it = _groups.begin(); group_it != _groups.end(); ++group_it) {
+    for (fextl::list<Option>::const_iterator it = (*group_it)->_opts.begin(); it != (*group_it)->_opts.end(); ++it) {
+      if (it->_action_kind != Option::ACTION_HELP and it->_action_kind != Option::ACTION_VERSION and
+          it->dest() != "" and seen.insert(it->dest()).second)
+        _dest_options.push_back(&*it);
+    }
+  }
+  _bound_options.clear();
+  for (fextl::list<Option>::const_iterator it = _opts.begin(); it != _opts.end(); ++it) {
+    if (it->_bind)
+      _bound_options.push_back(&*it);
+  }
+  for (fextl::list<OptionGroup const*>::const_iterator group_it = _groups.begin(); group_it != _groups.end(); ++group_it) {
+    for (fextl::list<Option>::const_iterator it = (*group_it)->_opts.begin(); it != (*group_it)->_opts.end(); ++it) {
+      if (it->_bind)
+        _bound_options.push_back(&*it);
+    }
+  }
+
+  _dest_sorted.resize(_dest_options.size());
+  for (size_t i = 0; i < _dest_sorted.size(); ++i)
+    _dest_sorted[i] = static_cast<unsigned int>(i);
+  const fextl::vector<Option const*>& d = _dest_options;
+  std::sort(_dest_sorted.begin(), _dest_sorted.end(),
+    [&d](unsigned int a, unsigned int b) { return d[a]->dest() < d[b]->dest(); });
+
+  std::fill(_short_table, _short_table + 256, static_cast<Option const*>(0));
+  for (optMap::const_iterator it = _optmap_s.begin(); it != _optmap_s.end(); ++it) {
+    if (it->first.length() == 1)
+      _short_table[static_cast<unsigned char>(it->first[0])] = it->second;
+  }
+}
+
+void OptionParser::index_group(const OptionGroup& group) {
   for (fextl::list<Option>::const_iterator oit = group._opts.begin(); oit != group._opts.end(); ++oit) {
     const Option& option = *oit;
     for (fextl::set<fextl::string>::const_iterator it = option._short_opts.begin(); it != option._short_opts.end(); ++it)
@@ -194,72 +417,198 @@ OptionParser& OptionParser::add_option_group(const OptionGroup& group) {
     for (fextl::set<fextl::string>::const_iterator it = option._long_opts.begin(); it != option._long_opts.end(); ++it)
       _optmap_l[*it] = &option;
   }
+}
+
+OptionParser& OptionParser::add_option_group(const OptionGroup& group) {
+  TRACE_SCOPE(t, REGISTRATION);
+  index_group(group);
   _groups.push_back(&group);
   return *this;
 }
 
-const Option& OptionParser::lookup_short_opt(const fextl::string& opt) const {
-  optMap::const_iterator it = _optmap_s.find(opt);
-  if (it == _optmap_s.end())
-    error(_("no such option") + fextl::string(": -") + opt);
-  return *it->second;
+OptionGroup& OptionParser::add_option_group(const fextl::string& title, const fextl::string& description /* = "" */) {
+  _owned_groups.push_back(OptionGroup(*this, title, description));
+  _groups.push_back(&_owned_groups.back());
+  return _owned_groups.back();
+}
+
+#if defined(__ELF__)
+extern "C" {
+extern const OptionDescriptor __start_optparse_registry[] __attribute__((weak));
+extern const OptionDescriptor __stop_optparse_registry[] __attribute__((weak));
+}
+#endif
+
+OptionParser& OptionParser::add_registered_options(bool groups /* = true */) {
+  TRACE_SCOPE(t, REGISTRATION);
+#if defined(__ELF__)
+  const OptionDescriptor* begin = __start_optparse_registry;
+  const OptionDescriptor* end = __stop_optparse_registry;
+  if (not begin or not end)
+    return *this;
+
+  fextl::vector<const OptionDescriptor*> sorted;
+  for (const OptionDescriptor* d = begin; d != end; ++d)
+    sorted.push_back(d);
+  std::sort(sorted.begin(), sorted.end(), [](const OptionDescriptor* a, const OptionDescriptor* b) {
+    int c = std::strcmp(a->_file, b->_file);
+    return c != 0 ? c < 0 : a->_order < b->_order;
+  });
+
+  // groups are created in order of first appearance
+  fextl::map<fextl::string, OptionGroup*> by_title;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    const OptionDescriptor* d = sorted[i];
+    OptionContainer* container = this;
+    if (groups and d->_group) {
+      OptionGroup*& g = by_title[d->_group];
+      if (not g)
+        g = &add_option_group(d->_group);
+      container = g;
+    }
+    Option& o = d->_opt2 ? container->add_option(d->_opt1, d->_opt2) : container->add_option(d->_opt1);
+    if (d->_action)
+      o.action(d->_action);
+    if (d->_type)
+      o.type(d->_type);
+    if (d->_dest)
+      o.dest(d->_dest);
+    if (d->_default)
+      o.set_default(fextl::string(d->_default));
+    if (d->_help)
+      o.help(d->_help);
+    if (d->_metavar)
+      o.metavar(d->_metavar);
+  }
+#else
+  (void) groups;
+#endif
+  return *this;
+}
+
+OptionParser& OptionParser::add_subcommand(const fextl::string& name, SubcommandFactory& factory, const fextl::string& help /* = "" */) {
+  if (_subcommands.find(name) == _subcommands.end())
+    _subcommand_names.push_back(name);
+  _subcommands[name] = &factory;
+  _subcommand_help[name] = help;
+  if (_usage == _("%prog [options]"))
+    _usage = _("%prog [options] <command> [args]");
+  return *this;
+}
+
+const Option& OptionParser::lookup_short_opt(const fextl::string& opt, const fextl::string& arg) const {
+  TRACE_SCOPE(t, LOOKUP);
+  Option const* o = (opt.length() == 1) ? _short_table[static_cast<unsigned char>(opt[0])] : 0;
+  if (not o)
+    error(_("no such option") + fextl::string(": -") + opt + suggest_long_opt(arg.substr(1)));
+  return *o;
 }
 
-void OptionParser::handle_short_opt(const fextl::string& opt, const fextl::string& arg) {
+void OptionParser::handle_short_opt(const fextl::string& arg) {
 
-  _parsed.emplace_back(fextl::string("-") + opt);
+  const size_t first = _arg_count - _remaining.size();
   _remaining.pop_front();
-  fextl::string value;
-
-  const Option& option = lookup_short_opt(opt);
-  if (option._nargs == 1) {
-    value = arg.substr(2);
-    if (value == "") {
-      if (_remaining.empty()) {
-        if (option._optional_value) {
-          value = option.get_default();
-          _parsed.emplace_back(value);
+
+  // walk the cluster in place, so "-abc..." stays linear in its length
+  for (size_t i = 1; i < arg.length(); ++i) {
+    const fextl::string opt = arg.substr(i, 1);
+    _parsed.emplace_back(fextl::string("-") + opt);
+    fextl::string value;
+
+    const Option& option = lookup_short_opt(opt, arg);
+    if (option._nargs == 1) {
+      value = arg.substr(i+1);
+      if (value == "") {
+        if (not has_remaining()) {
+          if (option._optional_value) {
+            value = option.get_default();
+            _parsed.emplace_back(value);
+          }
+          else {
+            error("-" + opt + " " + _("option requires an argument"));
+          }
         }
         else {
-          error("-" + opt + " " + _("option requires an argument"));
+          value = _remaining.front();
+          _remaining.pop_front();
+          _parsed.emplace_back(value);
         }
       }
-      else {
-        value = _remaining.front();
-        _remaining.pop_front();
-        _parsed.emplace_back(value);
-      }
+      _arg_spans.push_back(ArgSpan{&option, "-" + opt, value, first, _arg_count - _remaining.size()});
+      process_opt(option, fextl::string("-") + opt, value);
+      break;
     }
-  } else {
-    if (arg.length() > 2)
-      _remaining.push_front(fextl::string("-") + arg.substr(2));
-  }
 
-  process_opt(option, fextl::string("-") + opt, value);
+    _arg_spans.push_back(ArgSpan{&option, "-" + opt, value, first, first + 1});
+    process_opt(option, fextl::string("-") + opt, value);
+  }
 }
 
-const Option& OptionParser::lookup_long_opt(const fextl::string& opt) const {
+typedef std::pair<fextl::vector<fextl::string>::const_iterator, fextl::vector<fextl::string>::const_iterator> nameRange;
+
+//! The sorted names starting with opt, which follow each other; only opt if it is one of them
+static nameRange prefix_range(const fextl::vector<fextl::string>& names, const fextl::string& opt) {
+  fextl::vector<fextl::string>::const_iterator first = std::lower_bound(names.begin(), names.end(), opt);
+  fextl::vector<fextl::string>::const_iterator last = first;
+  if (first != names.end() and *first == opt)
+    ++last;
+  else {
+    while (last != names.end() and last->compare(0, opt.length(), opt) == 0)
+      ++last;
+  }
+  return nameRange(first, last);
+}
 
-  fextl::list<fextl::string> matching;
-  for (optMap::const_iterator it = _optmap_l.begin(); it != _optmap_l.end(); ++it) {
-    if (it->first.compare(0, opt.length(), opt) == 0) {
-      matching.push_back(it->first);
-      if (it->first.length() == opt.length())
-        break;
-    }
+const Option& OptionParser::lookup_long_opt(const fextl::string& opt, bool* negated /* = 0 */) const {
+  TRACE_SCOPE(t, LOOKUP);
+
+  nameRange r = prefix_range(_long_names, opt);
+  // "no-" forms of store_bool options are matched against their plain names
+  nameRange n(_neg_names.end(), _neg_names.end());
+  if (not _neg_names.empty()) {
+    if (opt.compare(0, 3, "no-") == 0)
+      n = prefix_range(_neg_names, opt.substr(3));
+    else if (fextl::string("no-").compare(0, opt.length(), opt) == 0)
+      n = nameRange(_neg_names.begin(), _neg_names.end());
   }
-  if (matching.size() > 1) {
-    fextl::string x = str_join_trans(", ", matching.begin(), matching.end(), str_wrap("--", ""));
+  if (r.first != r.second and *r.first == opt)
+    n.second = n.first;
+  else if (n.first != n.second and opt.length() > 3 and n.first->compare(opt.c_str() + 3) == 0) {
+    r.second = r.first;
+    n.second = n.first + 1;
+  }
+
+  if ((r.second - r.first) + (n.second - n.first) > 1) {
+    fextl::string x = str_join_trans(", ", r.first, r.second, str_wrap("--", ""));
+    if (n.first != n.second)
+      x += (x != "" ? ", " : "") + str_join_trans(", ", n.first, n.second, str_wrap("--no-", ""));
     error(_("ambiguous option") + fextl::string(": --") + opt + " (" + x + "?)");
   }
-  if (matching.size() == 0)
-    error(_("no such option") + fextl::string(": --") + opt);
+  if (r.first == r.second and n.first == n.second)
+    error(_("no such option") + fextl::string(": --") + opt + suggest_long_opt(opt));
+
+  if (negated)
+    *negated = (r.first == r.second);
+  if (r.first != r.second)
+    return *_long_table[r.first - _long_names.begin()];
+  return *_neg_table[n.first - _neg_names.begin()];
+}
 
-  return *_optmap_l.find(matching.front())->second;
+fextl::string OptionParser::suggest_long_opt(const fextl::string& opt) const {
+  // a single character is a short option, nothing to compare long names with
+  if (opt.length() < 2)
+    return "";
+  if (opt.compare(0, 3, "no-") == 0 and not _neg_names.empty()) {
+    fextl::string neg = str_suggest(opt.substr(3), _neg_names.begin(), _neg_names.end(), str_wrap("--no-", ""));
+    if (neg != "")
+      return neg;
+  }
+  return str_suggest(opt, _long_names.begin(), _long_names.end(), str_wrap("--", ""));
 }
 
 void OptionParser::handle_long_opt(const fextl::string& optstr) {
 
+  const size_t first = _arg_count - _remaining.size();
   _remaining.pop_front();
   fextl::string opt, value;
 
@@ -270,9 +619,19 @@ void OptionParser::handle_long_opt(const fextl::string& optstr) {
   } else
     opt = optstr;
 
-  const Option& option = lookup_long_opt(opt);
+  bool negated = false;
+  const Option& option = lookup_long_opt(opt, &negated);
+  if (option._action_kind == Option::ACTION_STORE_BOOL) {
+    // --X=0 and --X=1 spell out the value, --no-X takes none
+    if (delim != fextl::string::npos and negated)
+      error("--" + opt + " " + _("option does not take a value"));
+    else if (delim != fextl::string::npos and value != "0" and value != "1")
+      error(_("option") + fextl::string(" --") + opt + ": " + _("invalid value") + ": '" + value + "'");
+    else if (delim == fextl::string::npos)
+      value = negated ? "0" : "1";
+  }
   if (option._nargs == 1 and delim == fextl::string::npos) {
-    if (not _remaining.empty()) {
+    if (has_remaining()) {
       value = _remaining.front();
       _remaining.pop_front();
     }
@@ -281,6 +640,7 @@ void OptionParser::handle_long_opt(const fextl::string& optstr) {
   if (option._nargs == 1 and value == "")
     error("--" + opt + " " + _("option requires an argument"));
 
+  _arg_spans.push_back(ArgSpan{&option, "--" + opt, value, first, _arg_count - _remaining.size()});
   process_opt(option, fextl::string("--") + opt, value);
 }
 
@@ -289,141 +649,533 @@ Values& OptionParser::parse_args(const int argc, char const* const* const argv)
     prog(basename(argv[0]));
 
   _parsed.emplace_back(argv[0]);
-  return parse_args(&argv[1], &argv[argc]);
+  return parse_tokens(fextl::vector<fextl::string>(&argv[1], &argv[argc]), argv);
 }
 Values& OptionParser::parse_args(const fextl::vector<fextl::string>& v) {
+  return parse_tokens(v, 0);
+}
+Values& OptionParser::parse_tokens(const fextl::vector<fextl::string>& v, char const* const* const argv) {
 
   _remaining.assign(v.begin(), v.end());
+  _source = 0;
+  _keep_args = true;
+
+  // ArgvBuilder points at argv where possible, a copy is only kept without it
+  _argv = argv;
+  if (argv)
+    _args.clear();
+  else
+    _args = v;
+  _arg_count = v.size();
+  _arg_spans.clear();
+
+  begin_parse();
 
-  if (add_help_option()) {
+  TRACE_SCOPE(tokenize, TOKENIZE);
+  while (not _remaining.empty() and handle_arg())
+    ;
+  while (not _remaining.empty()) {
+    const fextl::string arg = _remaining.front();
+    _remaining.pop_front();
+    _leftover.push_back(arg);
+  }
+  TRACE_END(tokenize);
+
+  finish_parse();
+  return _values;
+}
+
+ParseIterator OptionParser::iterate(ArgSource& source, bool keep_args /* = false */) {
+  _remaining.clear();
+  _source = &source;
+  _keep_args = keep_args;
+  _argv = 0;
+  _args.clear();
+  _arg_count = 0;
+  _arg_spans.clear();
+
+  begin_parse();
+  return ParseIterator(*this);
+}
+
+void OptionParser::begin_parse() {
+  if (add_help_option() and _optmap_l.find("help") == _optmap_l.end()) {
     add_option("-h", "--help") .action("help") .help(_("show this help message and exit"));
     _opts.splice(_opts.begin(), _opts, --(_opts.end()));
   }
-  if (add_version_option() and version() != "") {
+  if (add_version_option() and version() != "" and _optmap_l.find("version") == _optmap_l.end()) {
     add_option("--version") .action("version") .help(_("show program's version number and exit"));
     _opts.splice(_opts.begin(), _opts, --(_opts.end()));
   }
+  build_lookup_tables();
+}
 
-  while (not _remaining.empty()) {
-    const fextl::string arg = _remaining.front();
+bool OptionParser::has_remaining() {
+  fextl::string arg;
+  if (_remaining.empty() and _source and _source->next(arg)) {
+    _remaining.push_back(arg);
+    if (_keep_args)
+      _args.push_back(arg);
+    ++_arg_count;
+  }
+  return not _remaining.empty();
+}
 
-    if (arg == "--") {
-      _remaining.pop_front();
-      break;
-    }
+bool OptionParser::handle_arg() {
+  const fextl::string arg = _remaining.front();
 
-    if (arg.substr(0,2) == "--") {
-      _parsed.emplace_back(arg);
-      handle_long_opt(arg.substr(2));
-    } else if (arg.substr(0,1) == "-" and arg.length() > 1) {
-      handle_short_opt(arg.substr(1,1), arg);
-    } else {
-      _remaining.pop_front();
-      _leftover.push_back(arg);
-      if (not interspersed_args())
-        break;
-    }
+  if (arg == "--") {
+    _remaining.pop_front();
+    return false;
   }
-  while (not _remaining.empty()) {
-    const fextl::string arg = _remaining.front();
+
+  if (arg.substr(0,2) == "--") {
+    _parsed.emplace_back(arg);
+    handle_long_opt(arg.substr(2));
+  } else if (arg.substr(0,1) == "-" and arg.length() > 1) {
+    handle_short_opt(arg);
+  } else {
     _remaining.pop_front();
     _leftover.push_back(arg);
+    if (not interspersed_args() or not _subcommands.empty())
+      return false;
   }
+  return true;
+}
+
+void OptionParser::finish_parse() {
+  _source = 0;
+  process_env();
 
+  TRACE_SCOPE(defaults, DEFAULTS);
   for (fextl::list<Option>::const_iterator it = _opts.begin(); it != _opts.end(); ++it) {
-    if (it->get_default() != "" and not _values.is_set(it->dest()))
+    if (it->get_default() != "" and not _values.is_set(it->dest())) {
       _values[it->dest()] = it->get_default();
+      _values.is_set_from_default(it->dest(), true);
+      if (it->_type_kind == Option::TYPE_CHOICE)
+        _values.choice(it->dest(), it->choice_index(it->get_default()));
+    }
   }
 
   for (fextl::list<OptionGroup const*>::iterator group_it = _groups.begin(); group_it != _groups.end(); ++group_it) {
     for (fextl::list<Option>::const_iterator it = (*group_it)->_opts.begin(); it != (*group_it)->_opts.end(); ++it) {
-      if (it->get_default() != "" and not _values.is_set(it->dest()))
+      if (it->get_default() != "" and not _values.is_set(it->dest())) {
         _values[it->dest()] = it->get_default();
+        _values.is_set_from_default(it->dest(), true);
+        if (it->_type_kind == Option::TYPE_CHOICE)
+          _values.choice(it->dest(), it->choice_index(it->get_default()));
+      }
     }
   }
 
-  return _values;
+  // bound variables also get defaults and values stored by other options with the same dest
+  for (size_t i = 0; i < _bound_options.size(); ++i)
+    store_bound(*_bound_options[i], "");
+  TRACE_END(defaults);
+
+  if (not _deferred_calls.empty())
+    run_deferred();
+
+  if (not _subcommands.empty() and not _leftover.empty())
+    parse_subcommand();
+}
+
+//! Puts back the previous values when a reparse is left by an exception from exit()
+class OptionParser::ReparseGuard {
+public:
+  ReparseGuard(OptionParser& p) : parser(p), old(p._values), done(false) {}
+  ~ReparseGuard() {
+    if (done)
+      return;
+    Values failed = parser._values;
+    parser._values = old;
+    parser.rebind(failed);
+  }
+  OptionParser& parser;
+  const Values old;
+  bool done;
+};
+
+fextl::set<fextl::string> OptionParser::reparse(const int argc, char const* const* const argv) {
+  ReparseGuard guard(*this);
+  reset();
+  _parsed.emplace_back(argv[0]);
+  parse_tokens(fextl::vector<fextl::string>(&argv[1], &argv[argc]), argv);
+  return finish_reparse(guard);
+}
+fextl::set<fextl::string> OptionParser::reparse(const fextl::vector<fextl::string>& v) {
+  ReparseGuard guard(*this);
+  reset();
+  parse_args(v);
+  return finish_reparse(guard);
+}
+
+fextl::set<fextl::string> OptionParser::finish_reparse(ReparseGuard& guard) {
+  guard.done = true;
+  rebind(guard.old);
+  fextl::set<fextl::string> changed = _values.changed(guard.old);
+  notify_changed(changed, guard.old);
+  return changed;
+}
+
+void OptionParser::reset() {
+  _values = Values();
+  _remaining.clear();
+  _leftover.clear();
+  _parsed.clear();
+  _arg_spans.clear();
+  _subcommand.clear();
+  _subparsers.clear();
+  _deferred_calls.clear();
+}
+
+void OptionParser::notify_changed(const fextl::set<fextl::string>& changed, const Values& old) const {
+  if (changed.empty())
+    return;
+
+  // each callback fires once per dest, even if several options share it
+  fextl::set<std::pair<fextl::string, ChangeCallback*> > fired;
+  fextl::list<Option const*> opts;
+  for (fextl::list<Option>::const_iterator it = _opts.begin(); it != _opts.end(); ++it)
+    opts.push_back(&*it);
+  for (fextl::list<OptionGroup const*>::const_iterator group_it = _groups.begin(); group_it != _groups.end(); ++group_it) {
+    for (fextl::list<Option>::const_iterator it = (*group_it)->_opts.begin(); it != (*group_it)->_opts.end(); ++it)
+      opts.push_back(&*it);
+  }
+
+  for (fextl::list<Option const*>::const_iterator it = opts.begin(); it != opts.end(); ++it) {
+    const Option& o = **it;
+    if (not o.on_change() or changed.find(o.dest()) == changed.end())
+      continue;
+    if (not fired.insert(std::make_pair(o.dest(), o.on_change())).second)
+      continue;
+    (*o.on_change())(o.dest(), old, _values, *this);
+  }
+}
+
+// the error slot of the deferred call running on this thread, and the parser
+// running it; other parsers used inside the callback still exit on errors
+static thread_local fextl::string* deferred_error = 0;
+static thread_local const OptionParser* deferred_parser = 0;
+
+//! One independent deferred call, or all calls of a queue in order
+class DeferredTask : public Task {
+public:
+  DeferredTask(const OptionParser& p) : parser(p) {}
+  void operator() () {
+    // a callback may run a parser with deferred calls of its own on this thread
+    fextl::string* const outer_error = deferred_error;
+    const OptionParser* const outer_parser = deferred_parser;
+    for (size_t i = 0; i < calls.size(); ++i) {
+      OptionParser::DeferredCall& call = *calls[i];
+      TRACE_SCOPE(t, CALLBACK);
+      deferred_error = &call.error;
+      deferred_parser = &parser;
+      (*call.option->callback())(*call.option, call.opt, call.value, parser);
+    }
+    deferred_error = outer_error;
+    deferred_parser = outer_parser;
+  }
+  const OptionParser& parser;
+  fextl::vector<OptionParser::DeferredCall*> calls;
+};
+
+void OptionParser::run_deferred() {
+  fextl::list<DeferredTask> tasks;
+  fextl::map<fextl::string, DeferredTask*> queues;
+  for (size_t i = 0; i < _deferred_calls.size(); ++i) {
+    DeferredCall& call = _deferred_calls[i];
+    const fextl::string& q = call.option->queue();
+    DeferredTask* task = (q != "") ? queues[q] : 0;
+    if (not task) {
+      tasks.emplace_back(*this);
+      task = &tasks.back();
+      if (q != "")
+        queues[q] = task;
+    }
+    task->calls.push_back(&call);
+  }
+
+  if (_executor) {
+    for (fextl::list<DeferredTask>::iterator it = tasks.begin(); it != tasks.end(); ++it)
+      _executor->submit(*it);
+    _executor->wait();
+  } else {
+    fextl::vector<DeferredTask*> pending;
+    for (fextl::list<DeferredTask>::iterator it = tasks.begin(); it != tasks.end(); ++it)
+      pending.push_back(&*it);
+    std::atomic<size_t> next(0);
+    size_t n = std::min<size_t>(_callback_threads, pending.size());
+    fextl::vector<std::thread> threads;
+    // the calling thread is one of the workers
+    for (size_t i = 1; i < n; ++i) {
+      threads.emplace_back([&pending, &next]() {
+        for (size_t t; (t = next.fetch_add(1)) < pending.size(); )
+          (*pending[t])();
+      });
+    }
+    for (size_t t; (t = next.fetch_add(1)) < pending.size(); )
+      (*pending[t])();
+    for (size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
+  }
+
+  fextl::string errors;
+  for (size_t i = 0; i < _deferred_calls.size(); ++i) {
+    if (_deferred_calls[i].error == "")
+      continue;
+    if (errors != "")
+      errors += "; ";
+    errors += _deferred_calls[i].error;
+  }
+  _deferred_calls.clear();
+  if (errors != "")
+    error(errors);
+}
+
+void OptionParser::callback_error(const fextl::string& msg) const {
+  error(msg);
+}
+
+void OptionParser::process_env() {
+  typedef fextl::unordered_map<fextl::string, Option const*> envMap;
+  envMap envmap;
+  uint64_t lengths = 0; // bit n set if a name of length n is declared, all names >= 63 share bit 63
+
+  for (fextl::list<Option>::const_iterator it = _opts.begin(); it != _opts.end(); ++it) {
+    if (it->env() != "") {
+      envmap[it->env()] = &*it;
+      lengths |= uint64_t(1) << std::min<size_t>(it->env().length(), 63);
+    }
+  }
+  for (fextl::list<OptionGroup const*>::iterator group_it = _groups.begin(); group_it != _groups.end(); ++group_it) {
+    for (fextl::list<Option>::const_iterator it = (*group_it)->_opts.begin(); it != (*group_it)->_opts.end(); ++it) {
+      if (it->env() != "") {
+        envmap[it->env()] = &*it;
+        lengths |= uint64_t(1) << std::min<size_t>(it->env().length(), 63);
+      }
+    }
+  }
+  if (envmap.empty() or not environ)
+    return;
+
+  // one scan of the environment, instead of a getenv() scan per option
+  for (char** e = environ; *e; ++e) {
+    const char* eq = strchr(*e, '=');
+    if (not eq or not (lengths & (uint64_t(1) << std::min<size_t>(eq - *e, 63))))
+      continue;
+    envMap::const_iterator it = envmap.find(fextl::string(*e, eq - *e));
+    if (it == envmap.end())
+      continue;
+
+    const Option& o = *it->second;
+    const fextl::string value(eq + 1);
+    // the command line takes precedence
+    if (_values.is_set_by_user(o.dest()))
+      continue;
+    // an empty variable counts as unset, a flag also needs a value other than "0"
+    if (value == "")
+      continue;
+    if (o._action_kind == Option::ACTION_STORE_BOOL)
+      process_opt(o, "$" + o.env(), (value == "0") ? "0" : "1");
+    else if (o._nargs == 0 and value == "0")
+      continue;
+    else
+      process_opt(o, "$" + o.env(), (o._nargs == 1) ? value : "");
+    _values.is_set_by_user(o.dest(), false);
+    _values.is_set_from_env(o.dest(), true);
+  }
+}
+
+void OptionParser::parse_subcommand() {
+  const fextl::string name = _leftover.front();
+  cmdMap::const_iterator it = _subcommands.find(name);
+  if (it == _subcommands.end())
+    error(_("no such command") + fextl::string(": ") + name);
+
+  _leftover.pop_front();
+  _parsed.push_back(name);
+  _subcommand = name;
+
+  _subparsers.clear();
+  _subparsers.emplace_back();
+  OptionParser& sub = _subparsers.back();
+  sub._parent = this;
+  sub.prog(prog() + " " + name);
+  sub.description(_subcommand_help.find(name)->second);
+  (*it->second)(sub);
+
+  sub.parse_args(_leftover.begin(), _leftover.end());
+  _leftover.clear();
 }
 
 void OptionParser::process_opt(const Option& o, const fextl::string& opt, const fextl::string& value) {
-  if (o.action() == "store") {
-    fextl::string err = o.check_type(opt, value);
-    if (err != "")
-      error(err);
-    _values[o.dest()] = value;
-    _values.is_set_by_user(o.dest(), true);
-  }
-  else if (o.action() == "store_const") {
-    _values[o.dest()] = o.get_const();
-    _values.is_set_by_user(o.dest(), true);
-  }
-  else if (o.action() == "store_true") {
-    _values[o.dest()] = "1";
-    _values.is_set_by_user(o.dest(), true);
-  }
-  else if (o.action() == "store_false") {
-    _values[o.dest()] = "0";
-    _values.is_set_by_user(o.dest(), true);
-  }
-  else if (o.action() == "append") {
-    fextl::string err = o.check_type(opt, value);
-    if (err != "")
-      error(err);
-    _values[o.dest()] = value;
-    _values.all(o.dest()).push_back(value);
-    _values.is_set_by_user(o.dest(), true);
-  }
-  else if (o.action() == "append_const") {
-    _values[o.dest()] = o.get_const();
-    _values.all(o.dest()).push_back(o.get_const());
-    _values.is_set_by_user(o.dest(), true);
-  }
-  else if (o.action() == "count") {
-    _values[o.dest()] = str_inc(_values[o.dest()]);
-    _values.is_set_by_user(o.dest(), true);
-  }
-  else if (o.action() == "help") {
-    print_help();
-    std::exit(0);
-  }
-  else if (o.action() == "version") {
-    print_version();
-    std::exit(0);
-  }
-  else if (o.action() == "callback" && o.callback()) {
-    fextl::string err = o.check_type(opt, value);
-    if (err != "")
-      error(err);
-    (*o.callback())(o, opt, value, *this);
+  switch (o._action_kind) {
+    case Option::ACTION_STORE: {
+      size_t choice = Values::npos;
+      fextl::string err = o.check_type(opt, value, &choice);
+      if (err != "")
+        error(err);
+      _values[o.dest()] = value;
+      if (choice != Values::npos)
+        _values.choice(o.dest(), choice);
+      _values.is_set_by_user(o.dest(), true);
+      break;
+    }
+    case Option::ACTION_STORE_CONST:
+      _values[o.dest()] = o.get_const();
+      _values.is_set_by_user(o.dest(), true);
+      break;
+    case Option::ACTION_STORE_TRUE:
+      _values[o.dest()] = "1";
+      _values.is_set_by_user(o.dest(), true);
+      break;
+    case Option::ACTION_STORE_FALSE:
+      _values[o.dest()] = "0";
+      _values.is_set_by_user(o.dest(), true);
+      break;
+    case Option::ACTION_STORE_BOOL:
+      _values[o.dest()] = (value == "0") ? "0" : "1";
+      _values.is_set_by_user(o.dest(), true);
+      break;
+    case Option::ACTION_APPEND: {
+      size_t choice = Values::npos;
+      fextl::string err = o.check_type(opt, value, &choice);
+      if (err != "")
+        error(err);
+      _values[o.dest()] = value;
+      if (choice != Values::npos)
+        _values.choice(o.dest(), choice);
+      _values.all(o.dest()).push_back(value);
+      _values.is_set_by_user(o.dest(), true);
+      break;
+    }
+    case Option::ACTION_APPEND_CONST:
+      _values[o.dest()] = o.get_const();
+      _values.all(o.dest()).push_back(o.get_const());
+      _values.is_set_by_user(o.dest(), true);
+      break;
+    case Option::ACTION_COUNT:
+      _values[o.dest()] = str_inc(_values[o.dest()]);
+      _values.is_set_by_user(o.dest(), true);
+      break;
+    case Option::ACTION_HELP:
+      print_help();
+      std::exit(0);
+    case Option::ACTION_VERSION:
+      print_version();
+      std::exit(0);
+    case Option::ACTION_CALLBACK: {
+      if (not o.callback())
+        break;
+      fextl::string err = o.check_type(opt, value);
+      if (err != "")
+        error(err);
+      if (o.deferred()) {
+        DeferredCall call = { &o, opt, value, "" };
+        _deferred_calls.push_back(call);
+      } else {
+        TRACE_SCOPE(t, CALLBACK);
+        (*o.callback())(o, opt, value, *this);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+
+  if (o._bind)
+    store_bound(o, opt);
+}
+
+void OptionParser::store_bound(const Option& o, const fextl::string& opt) {
+  std::optional<const fextl::string*> value = const_cast<const Values&>(_values)[o.dest()];
+  if (not value)
+    return;
+  if (not (*o._bind)(o._bind_target, **value)) {
+    fextl::string name = opt;
+    if (name == "")
+      name = (not o._long_opts.empty()) ? "--" + *o._long_opts.begin() : "-" + *o._short_opts.begin();
+    error(_("option") + fextl::string(" ") + name + ": " + _("invalid value") + ": '" + **value + "'");
+  }
+}
+
+void OptionParser::rebind(const Values& before) {
+  const Values& values = _values;
+  for (size_t i = 0; i < _bound_options.size(); ++i) {
+    const Option& o = *_bound_options[i];
+    std::optional<const fextl::string*> value = values[o.dest()];
+    // the values were already converted once, so they cannot fail here
+    if (value)
+      (*o._bind)(o._bind_target, **value);
+    else if (before.is_set(o.dest()))
+      (*o._bind_reset)(o._bind_target);
   }
 }
 
 fextl::string OptionParser::format_help() const {
-  fextl::stringstream ss;
+  TRACE_SCOPE(t, HELP);
+  fextl::string out;
 
   if (usage() != SUPPRESS_USAGE)
-    ss << get_usage() << std::endl;
+    out += get_usage() + "\n";
 
-  if (description() != "")
-    ss << str_format(description(), 0, cols()) << std::endl;
+  if (description() != "") {
+    str_format(out, description(), 0, cols());
+    out += '\n';
+  }
 
-  ss << _("Options") << ":" << std::endl;
-  ss << format_option_help();
+  out += _("Options");
+  out += ":\n";
+  format_option_help(out, 2);
 
   for (fextl::list<OptionGroup const*>::const_iterator it = _groups.begin(); it != _groups.end(); ++it) {
     const OptionGroup& group = **it;
-    ss << std::endl << "  " << group.title() << ":" << std::endl;
+    out += "\n  " + group.title() + ":\n";
     if (group.description() != "") {
       unsigned int malus = 4; // Python seems to not use full length
-      ss << str_format(group.description(), 4, cols() - malus) << std::endl;
+      str_format(out, group.description(), 4, cols() - malus);
+      out += '\n';
     }
-    ss << group.format_option_help(4);
+    group.format_option_help(out, 4);
   }
 
-  if (epilog() != "")
-    ss << std::endl << str_format(epilog(), 0, cols());
+  format_subcommand_help(out);
 
-  return ss.str();
+  if (epilog() != "") {
+    out += '\n';
+    str_format(out, epilog(), 0, cols());
+  }
+
+  return out;
+}
+void OptionParser::format_subcommand_help(fextl::string& out) const {
+  if (_subcommand_names.empty())
+    return;
+
+  unsigned int width = cols();
+  unsigned int opt_width = std::min(width*3/10, 36u);
+
+  out += '\n';
+  out += _("Commands");
+  out += ":\n";
+  for (fextl::list<fextl::string>::const_iterator it = _subcommand_names.begin(); it != _subcommand_names.end(); ++it) {
+    const fextl::string& help = _subcommand_help.find(*it)->second;
+    size_t h = out.size();
+    out += "  " + *it;
+    h = out.size() - h;
+    bool indent_first = false;
+    if (h >= (opt_width-1)) {
+      out += '\n';
+      indent_first = true;
+    } else {
+      out.append(opt_width - h, ' ');
+      if (help == "")
+        out += '\n';
+    }
+    if (help != "")
+      str_format(out, help, opt_width, width, false, indent_first);
+  }
 }
 void OptionParser::print_help() const {
   std::cout << format_help();
@@ -467,9 +1219,18 @@ void OptionParser::print_version() const {
 }
 
 void OptionParser::exit() const {
+  // a subcommand parser exits the way its parent does
+  if (_parent)
+    _parent->exit();
   std::exit(EXIT_FAILURE);
 }
 void OptionParser::error(const fextl::string& msg) const {
+  // exiting while other deferred callbacks run is undefined, report once all have finished
+  if (deferred_error and deferred_parser == this) {
+    if (*deferred_error == "")
+      *deferred_error = msg;
+    return;
+  }
   print_usage(std::cerr);
   std::cerr << prog() << ": " << _("error") << ": " << msg << std::endl;
   exit();
@@ -481,6 +1242,67 @@ std::optional<const fextl::string*> Values::operator[] (const fextl::string& d)
   strMap::const_iterator it = _map.find(d);
   return (it != _map.end()) ? std::optional(&it->second) : std::nullopt;
 }
+fextl::set<fextl::string> Values::changed(const Values& old) const {
+  fextl::set<fextl::string> diff;
+
+  for (strMap::const_iterator it = _map.begin(); it != _map.end(); ++it) {
+    strMap::const_iterator o = old._map.find(it->first);
+    if (o == old._map.end() or o->second != it->second)
+      diff.insert(it->first);
+  }
+  for (strMap::const_iterator o = old._map.begin(); o != old._map.end(); ++o) {
+    if (_map.find(o->first) == _map.end())
+      diff.insert(o->first);
+  }
+
+  // all() creates empty lists on access, so a missing list equals an empty one
+  static const fextl::list<fextl::string> none;
+  for (lstMap::const_iterator it = _appendMap.begin(); it != _appendMap.end(); ++it) {
+    lstMap::const_iterator o = old._appendMap.find(it->first);
+    if (it->second != ((o != old._appendMap.end()) ? o->second : none))
+      diff.insert(it->first);
+  }
+  for (lstMap::const_iterator o = old._appendMap.begin(); o != old._appendMap.end(); ++o) {
+    if (_appendMap.find(o->first) == _appendMap.end() and not o->second.empty())
+      diff.insert(o->first);
+  }
+
+  // a value that moved between the command line, the environment and the defaults changed too
+  const fextl::set<fextl::string>* sets[3][2] = {
+    { &_userSet, &old._userSet }, { &_envSet, &old._envSet }, { &_defaultSet, &old._defaultSet }
+  };
+  for (int s = 0; s < 3; ++s) {
+    for (fextl::set<fextl::string>::const_iterator it = sets[s][0]->begin(); it != sets[s][0]->end(); ++it) {
+      if (sets[s][1]->find(*it) == sets[s][1]->end())
+        diff.insert(*it);
+    }
+    for (fextl::set<fextl::string>::const_iterator it = sets[s][1]->begin(); it != sets[s][1]->end(); ++it) {
+      if (sets[s][0]->find(*it) == sets[s][0]->end())
+        diff.insert(*it);
+    }
+  }
+
+  return diff;
+}
+size_t Values::choice(const fextl::string& d) const {
+  fextl::map<fextl::string, size_t>::const_iterator it = _choiceMap.find(d);
+  return (it != _choiceMap.end()) ? it->second : npos;
+}
+
+void Values::is_set_from_env(const fextl::string& d, bool yes) {
+  if (yes)
+    _envSet.insert(d);
+  else
+    _envSet.erase(d);
+}
+
+void Values::is_set_from_default(const fextl::string& d, bool yes) {
+  if (yes)
+    _defaultSet.insert(d);
+  else
+    _defaultSet.erase(d);
+}
+
 void Values::is_set_by_user(const fextl::string& d, bool yes) {
   if (yes)
     _userSet.insert(d);
@@ -489,38 +1311,143 @@ void Values::is_set_by_user(const fextl::string& d, bool yes) {
 }
 ////////// } class Values //////////
 
-////////// class Option { //////////
-fextl::string Option::check_type(const fextl::string& opt, const fextl::string& val) const {
-  fextl::istringstream ss(val);
-  fextl::stringstream err;
+////////// class Snapshot { //////////
+Snapshot::Snapshot(const Values& v) {
+  _dests.reserve(v._map.size());
+  _items.reserve(v._map.size());
+  _strs.reserve(v._map.size());
+  for (strMap::const_iterator it = v._map.begin(); it != v._map.end(); ++it) {
+    const char* begin = it->second.c_str();
+    Item item;
+    item.i = strtoll(begin, 0, 10);
+    item.d = strtod(begin, 0);
+    item.user = v.is_set_by_user(it->first);
+    _dests.push_back(it->first);
+    _items.push_back(item);
+    _strs.push_back(it->second);
+  }
+  for (lstMap::const_iterator it = v._appendMap.begin(); it != v._appendMap.end(); ++it)
+    _all[it->first].assign(it->second.begin(), it->second.end());
+}
+
+size_t Snapshot::index(const fextl::string& d) const {
+  fextl::vector<fextl::string>::const_iterator it = std::lower_bound(_dests.begin(), _dests.end(), d);
+  return (it != _dests.end() and *it == d) ? static_cast<size_t>(it - _dests.begin()) : npos;
+}
+
+const fextl::vector<fextl::string>& Snapshot::all(const fextl::string& d) const {
+  static const fextl::vector<fextl::string> none;
+  fextl::map<fextl::string, fextl::vector<fextl::string> >::const_iterator it = _all.find(d);
+  return (it != _all.end()) ? it->second : none;
+}
+
+// Readers register in a counter of the current epoch; publish() swaps the
+// pointer, flips the epoch and waits for the old epoch's readers to leave.
+// Each thread keeps to one stripe of counters, assigned round robin.
+SnapshotCell::Reader::Reader(const SnapshotCell& c) {
+  static std::atomic<unsigned int> next_stripe(0);
+  static thread_local const unsigned int stripe = next_stripe.fetch_add(1) % STRIPES;
+  while (true) {
+    unsigned long e = c._epoch.load();
+    _count = &c._readers[e & 1][stripe].n;
+    _count->fetch_add(1);
+    if (c._epoch.load() == e)
+      break;
+    _count->fetch_sub(1);
+  }
+  _snapshot = c._current.load();
+}
 
-  if (type() == "int" || type() == "long") {
-    long t;
-    if (not (ss >> t))
-      err << _("option") << " " << opt << ": " << _("invalid integer value") << ": '" << val << "'";
+SnapshotCell::SnapshotCell() : _current(0), _epoch(0) {
+  for (unsigned int i = 0; i < STRIPES; ++i) {
+    _readers[0][i].n = 0;
+    _readers[1][i].n = 0;
   }
-  else if (type() == "float" || type() == "double") {
-    double t;
-    if (not (ss >> t))
-      err << _("option") << " " << opt << ": " << _("invalid floating-point value") << ": '" << val << "'";
+}
+
+void SnapshotCell::publish(const Values& v) {
+  fextl::unique_ptr<Snapshot> old(_current.exchange(fextl::make_unique<Snapshot>(v).release()));
+  unsigned long e = _epoch.fetch_add(1);
+  for (unsigned int i = 0; i < STRIPES; ++i) {
+    while (_readers[e & 1][i].n.load() != 0)
+      std::this_thread::yield();
   }
-  else if (type() == "choice") {
-    if (find(choices().begin(), choices().end(), val) == choices().end()) {
-      fextl::list<fextl::string> tmp = choices();
-      transform(tmp.begin(), tmp.end(), tmp.begin(), str_wrap("'"));
+}
+
+SnapshotCell::~SnapshotCell() {
+  fextl::unique_ptr<Snapshot> current(_current.load());
+}
+////////// } class Snapshot //////////
+
+////////// class Option { //////////
+fextl::string Option::check_type(const fextl::string& opt, const fextl::string& val, size_t* choice /* = 0 */) const {
+  TRACE_SCOPE(t, TYPE_CHECK);
+  fextl::stringstream err;
+
+  switch (_type_kind) {
+    case TYPE_INT: {
+      fextl::istringstream ss(val);
+      long t;
+      if (not (ss >> t))
+        err << _("option") << " " << opt << ": " << _("invalid integer value") << ": '" << val << "'";
+      break;
+    }
+    case TYPE_FLOAT: {
+      fextl::istringstream ss(val);
+      double t;
+      if (not (ss >> t))
+        err << _("option") << " " << opt << ": " << _("invalid floating-point value") << ": '" << val << "'";
+      break;
+    }
+    case TYPE_CHOICE: {
+      size_t i = choice_index(val);
+      if (choice)
+        *choice = i;
+      if (i != Values::npos)
+        break;
       err << _("option") << " " << opt << ": " << _("invalid choice") << ": '" << val << "'"
-        << " (" << _("choose from") << " " << str_join(", ", tmp.begin(), tmp.end()) << ")";
+        << " (" << _("choose from") << " ";
+      for (fextl::list<fextl::string>::const_iterator it = choices().begin(); it != choices().end(); ++it)
+        err << (it != choices().begin() ? ", '" : "'") << *it << "'";
+      err << ")" << str_suggest(val, choices().begin(), choices().end(), str_wrap("'"));
+      break;
     }
-  }
-  else if (type() == "complex") {
-    std::complex<double> t;
-    if (not (ss >> t))
-      err << _("option") << " " << opt << ": " << _("invalid complex value") << ": '" << val << "'";
+    case TYPE_COMPLEX: {
+      fextl::istringstream ss(val);
+      std::complex<double> t;
+      if (not (ss >> t))
+        err << _("option") << " " << opt << ": " << _("invalid complex value") << ": '" << val << "'";
+      break;
+    }
+    default:
+      return fextl::string();
   }
 
   return err.str();
 }
 
+void Option::index_choices() {
+  _choices_sorted.clear();
+  _choices_sorted.reserve(_choices.size());
+  unsigned int i = 0;
+  for (fextl::list<fextl::string>::const_iterator it = _choices.begin(); it != _choices.end(); ++it)
+    _choices_sorted.push_back(std::make_pair(*it, i++));
+  // stable, so that of duplicate choices the first one is found
+  std::stable_sort(_choices_sorted.begin(), _choices_sorted.end(),
+    [](const std::pair<fextl::string, unsigned int>& a, const std::pair<fextl::string, unsigned int>& b) {
+      return a.first < b.first;
+    });
+}
+
+size_t Option::choice_index(const fextl::string& val) const {
+  fextl::vector<std::pair<fextl::string, unsigned int> >::const_iterator it =
+    std::lower_bound(_choices_sorted.begin(), _choices_sorted.end(), val,
+      [](const std::pair<fextl::string, unsigned int>& a, const fextl::string& v) { return a.first < v; });
+  if (it == _choices_sorted.end() or it->first != val)
+    return Values::npos;
+  return it->second;
+}
+
 fextl::string Option::format_option_help(unsigned int indent /* = 2 */) const {
 
   fextl::string mvar_short, mvar_long;
@@ -550,36 +1477,52 @@ fextl::string Option::format_option_help(unsigned int indent /* = 2 */) const {
   }
   if (not _long_opts.empty())
     ss << str_join_trans(", ", _long_opts.begin(), _long_opts.end(), str_wrap("--", mvar_long));
+  // one line for both forms of a store_bool option
+  if (_action_kind == ACTION_STORE_BOOL and not _long_opts.empty())
+    ss << ", " << str_join_trans(", ", _long_opts.begin(), _long_opts.end(), str_wrap("--no-", ""));
 
   return ss.str();
 }
 
-fextl::string Option::format_help(unsigned int indent /* = 2 */) const {
-  fextl::stringstream ss;
+void Option::format_help(fextl::string& out, unsigned int indent /* = 2 */) const {
   fextl::string h = format_option_help(indent);
   unsigned int width = cols();
   unsigned int opt_width = std::min(width*3/10, 36u);
   bool indent_first = false;
-  ss << h;
+  out += h;
   // if the option list is too long, start a new paragraph
   if (h.length() >= (opt_width-1)) {
-    ss << std::endl;
+    out += '\n';
     indent_first = true;
   } else {
-    ss << fextl::string(opt_width - h.length(), ' ');
+    out.append(opt_width - h.length(), ' ');
     if (help() == "")
-      ss << std::endl;
+      out += '\n';
   }
   if (help() != "") {
-    fextl::string help_str = (get_default() != "") ? str_replace(help(), "%default", get_default()) : help();
-    ss << str_format(help_str, opt_width, width, false, indent_first);
+    if (get_default() != "")
+      str_format(out, help(), opt_width, width, false, indent_first, "%default", get_default());
+    else
+      str_format(out, help(), opt_width, width, false, indent_first);
   }
-  return ss.str();
 }
 
 Option& Option::action(const fextl::string& a) {
   _action = a;
-  if (a == "store_const" || a == "store_true" || a == "store_false" ||
+  if (a == "store") _action_kind = ACTION_STORE;
+  else if (a == "store_const") _action_kind = ACTION_STORE_CONST;
+  else if (a == "store_true") _action_kind = ACTION_STORE_TRUE;
+  else if (a == "store_false") _action_kind = ACTION_STORE_FALSE;
+  else if (a == "append") _action_kind = ACTION_APPEND;
+  else if (a == "append_const") _action_kind = ACTION_APPEND_CONST;
+  else if (a == "count") _action_kind = ACTION_COUNT;
+  else if (a == "help") _action_kind = ACTION_HELP;
+  else if (a == "version") _action_kind = ACTION_VERSION;
+  else if (a == "callback") _action_kind = ACTION_CALLBACK;
+  else if (a == "store_bool") _action_kind = ACTION_STORE_BOOL;
+  else _action_kind = ACTION_OTHER;
+
+  if (a == "store_const" || a == "store_true" || a == "store_false" || a == "store_bool" ||
       a == "append_const" || a == "count" || a == "help" || a == "version") {
     nargs(0);
   } else if (a == "callback") {
@@ -592,6 +1535,13 @@ Option& Option::action(const fextl::string& a) {
 
 Option& Option::type(const fextl::string& t) {
   _type = t;
+  if (t == "string") _type_kind = TYPE_STRING;
+  else if (t == "int" || t == "long") _type_kind = TYPE_INT;
+  else if (t == "float" || t == "double") _type_kind = TYPE_FLOAT;
+  else if (t == "choice") _type_kind = TYPE_CHOICE;
+  else if (t == "complex") _type_kind = TYPE_COMPLEX;
+  else if (t == "") _type_kind = TYPE_NONE;
+  else _type_kind = TYPE_OTHER;
   nargs((t == "") ? 0 : 1);
   return *this;
 }
@@ -605,4 +1555,490 @@ const fextl::string& Option::get_default() const {
 }
 ////////// } class Option //////////
 
+////////// class ParseIterator { //////////
+void ParseIterator::release() {
+  OptionParser& p = _parser;
+  p._arg_spans.clear();
+  _span = 0;
+  p._parsed.clear();
+  // a subcommand is parsed from the positional arguments at the end
+  if (p._subcommands.empty())
+    p._leftover.clear();
+}
+
+bool ParseIterator::next(ParseEvent& e) {
+  OptionParser& p = _parser;
+
+  // the previous events have been consumed
+  if (not p._keep_args and _span == p._arg_spans.size())
+    release();
+
+  // each option of a short option cluster is an event of its own
+  if (_span < p._arg_spans.size()) {
+    const OptionParser::ArgSpan& s = p._arg_spans[_span++];
+    e.kind = ParseEvent::OPTION;
+    e.option = s.option;
+    e.opt = s.opt;
+    e.value = s.value;
+    return true;
+  }
+  if (_done)
+    return false;
+  if (not p.has_remaining()) {
+    _done = true;
+    p.finish_parse();
+    return false;
+  }
+
+  e.option = 0;
+  e.opt.clear();
+  if (_rest) {
+    e.kind = ParseEvent::POSITIONAL;
+    e.value = p._remaining.front();
+    p._remaining.pop_front();
+    p._leftover.push_back(e.value);
+    return true;
+  }
+
+  const size_t leftover = p._leftover.size();
+  _rest = not p.handle_arg();
+  if (_span < p._arg_spans.size())
+    return next(e);
+  if (p._leftover.size() != leftover) {
+    e.kind = ParseEvent::POSITIONAL;
+    e.value = p._leftover.back();
+  } else {
+    e.kind = ParseEvent::TERMINATOR;
+    e.value.clear();
+  }
+  return true;
+}
+////////// } class ParseIterator //////////
+
+////////// class EffectiveConfig { //////////
+EffectiveConfig::EffectiveConfig(const OptionParser& p) {
+  const Values& v = p._values;
+  _items.resize(p._dest_options.size());
+  for (size_t i = 0; i < _items.size(); ++i) {
+    Item item = { &p._dest_options[i]->dest(), 0, 0, p._dest_options[i], UNSET };
+    _items[i] = item;
+  }
+
+  // all maps are ordered by dest, so one merge in dest order finds
+  // everything about each dest without a lookup of its own
+  strMap::const_iterator m = v._map.begin();
+  lstMap::const_iterator a = v._appendMap.begin();
+  fextl::set<fextl::string>::const_iterator u = v._userSet.begin();
+  fextl::set<fextl::string>::const_iterator e = v._envSet.begin();
+  fextl::set<fextl::string>::const_iterator f = v._defaultSet.begin();
+  strMap::const_iterator d = p._defaults.begin();
+  fextl::vector<strMap::const_iterator> extra;
+  for (size_t k = 0; k < p._dest_sorted.size(); ++k) {
+    Item& item = _items[p._dest_sorted[k]];
+    const fextl::string& dest = *item.dest;
+    for (; m != v._map.end() and m->first < dest; ++m)
+      extra.push_back(m);
+    for (; a != v._appendMap.end() and a->first < dest; ++a)
+      ;
+    for (; u != v._userSet.end() and *u < dest; ++u)
+      ;
+    for (; e != v._envSet.end() and *e < dest; ++e)
+      ;
+    for (; f != v._defaultSet.end() and *f < dest; ++f)
+      ;
+    for (; d != p._defaults.end() and d->first < dest; ++d)
+      ;
+    if (m == v._map.end() or m->first != dest)
+      continue;
+    item.value = &(m++)->second;
+    if (a != v._appendMap.end() and a->first == dest and not a->second.empty())
+      item.all = &a->second;
+    if (u != v._userSet.end() and *u == dest)
+      item.source = USER;
+    else if (e != v._envSet.end() and *e == dest)
+      item.source = ENVIRONMENT;
+    else if (f == v._defaultSet.end() or *f != dest)
+      item.source = PROGRAM;
+    else if (d != p._defaults.end() and d->first == dest)
+      item.source = SET_DEFAULTS;
+    else
+      item.source = DEFAULT;
+  }
+  for (; m != v._map.end(); ++m)
+    extra.push_back(m);
+
+  for (size_t i = 0; i < extra.size(); ++i) {
+    lstMap::const_iterator all = v._appendMap.find(extra[i]->first);
+    Item item = { &extra[i]->first, &extra[i]->second, 0, 0, PROGRAM };
+    if (all != v._appendMap.end() and not all->second.empty())
+      item.all = &all->second;
+    if (v.is_set_by_user(extra[i]->first))
+      item.source = USER;
+    else if (v.is_set_from_env(extra[i]->first))
+      item.source = ENVIRONMENT;
+    else if (v.is_set_from_default(extra[i]->first))
+      item.source = SET_DEFAULTS;
+    _items.push_back(item);
+  }
+}
+
+const char* EffectiveConfig::source_name(Source s) {
+  switch (s) {
+    case DEFAULT: return "default";
+    case SET_DEFAULTS: return "set_defaults";
+    case ENVIRONMENT: return "environment";
+    case USER: return "user";
+    case PROGRAM: return "program";
+    default: return "unset";
+  }
+}
+
+static void json_string(fextl::string& out, const fextl::string& s) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  for (size_t i = 0; i < s.length(); ++i) {
+    const unsigned char c = static_cast<unsigned char>(s[i]);
+    if (c == '"' or c == '\\') {
+      out += '\\';
+      out += static_cast<char>(c);
+    } else if (c < 0x20) {
+      out.append("\\u00");
+      out += hex[c >> 4];
+      out += hex[c & 0xf];
+    } else
+      out += static_cast<char>(c);
+  }
+  out += '"';
+}
+
+void EffectiveConfig::write_json(fextl::string& out) const {
+  out += '{';
+  for (const_iterator it = begin(); it != end(); ++it) {
+    if (it != begin())
+      out += ',';
+    json_string(out, *it->dest);
+    out.append(":{\"value\":");
+    if (it->all) {
+      out += '[';
+      for (fextl::list<fextl::string>::const_iterator v = it->all->begin(); v != it->all->end(); ++v) {
+        if (v != it->all->begin())
+          out += ',';
+        json_string(out, *v);
+      }
+      out += ']';
+    } else if (it->value)
+      json_string(out, *it->value);
+    else
+      out.append("null");
+    out.append(",\"source\":\"");
+    out.append(source_name(it->source));
+    out.append("\"}");
+  }
+  out += '}';
+}
+
+static void line_value(fextl::string& out, EffectiveConfig::Source source, const fextl::string& dest, const fextl::string& value) {
+  out.append(EffectiveConfig::source_name(source));
+  out += ' ';
+  out += dest;
+  out += '=';
+  for (size_t i = 0; i < value.length(); ++i) {
+    if (value[i] == '\\')
+      out.append("\\\\");
+    else if (value[i] == '\n')
+      out.append("\\n");
+    else
+      out += value[i];
+  }
+  out += '\n';
+}
+
+void EffectiveConfig::write_lines(fextl::string& out) const {
+  for (const_iterator it = begin(); it != end(); ++it) {
+    if (it->all) {
+      for (fextl::list<fextl::string>::const_iterator v = it->all->begin(); v != it->all->end(); ++v)
+        line_value(out, it->source, *it->dest, *v);
+    } else
+      line_value(out, it->source, *it->dest, it->value ? *it->value : fextl::string());
+  }
+}
+////////// } class EffectiveConfig //////////
+
+////////// class ArgvBuilder { //////////
+ArgvBuilder& ArgvBuilder::remove(const fextl::string& dest) {
+  _removed.insert(dest);
+  _overrides.erase(dest);
+  return *this;
+}
+ArgvBuilder& ArgvBuilder::set(const fextl::string& dest, const fextl::string& value /* = "" */) {
+  _removed.erase(dest);
+  _overrides[dest] = value;
+  return *this;
+}
+ArgvBuilder& ArgvBuilder::append(const fextl::string& dest, const fextl::string& value /* = "" */) {
+  _appends.push_back(std::make_pair(dest, value));
+  return *this;
+}
+
+Option const* ArgvBuilder::find_option(const fextl::string& dest, bool value) const {
+  Option const* any = 0;
+  for (fextl::list<Option>::const_iterator it = _parser._opts.begin(); it != _parser._opts.end(); ++it) {
+    if (it->dest() != dest)
+      continue;
+    if ((it->nargs() == 1) == value)
+      return &*it;
+    if (not any)
+      any = &*it;
+  }
+  for (fextl::list<OptionGroup const*>::const_iterator group_it = _parser._groups.begin(); group_it != _parser._groups.end(); ++group_it) {
+    for (fextl::list<Option>::const_iterator it = (*group_it)->_opts.begin(); it != (*group_it)->_opts.end(); ++it) {
+      if (it->dest() != dest)
+        continue;
+      if ((it->nargs() == 1) == value)
+        return &*it;
+      if (not any)
+        any = &*it;
+    }
+  }
+  return any;
+}
+
+void ArgvBuilder::spell(Option const* option, const fextl::string& opt, const fextl::string& value) {
+  if (opt.compare(0, 2, "--") == 0) {
+    _entries.push_back(Entry{0, option->_nargs == 1 ? opt + "=" + value : opt});
+    return;
+  }
+  _entries.push_back(Entry{0, opt});
+  if (option->_nargs == 1)
+    _entries.push_back(Entry{0, value});
+}
+
+void ArgvBuilder::spell(const fextl::string& dest, const fextl::string& value) {
+  // dests without an option are ignored
+  Option const* option = find_option(dest, value != "");
+  if (not option)
+    return;
+  if (option->_action_kind == Option::ACTION_STORE_BOOL and not option->_long_opts.empty())
+    spell(option, (value == "0" ? "--no-" : "--") + *option->_long_opts.begin(), value);
+  else if (not option->_long_opts.empty())
+    spell(option, "--" + *option->_long_opts.begin(), value);
+  else if (not option->_short_opts.empty())
+    spell(option, "-" + *option->_short_opts.begin(), value);
+}
+
+char* const* ArgvBuilder::build() {
+  const fextl::vector<OptionParser::ArgSpan>& spans = _parser._arg_spans;
+  // nothing to copy if iterate() dropped the arguments
+  const size_t n = (_parser._argv or _parser._keep_args) ? _parser._arg_count : 0;
+  _entries.clear();
+
+  if (_has_program)
+    _entries.push_back(Entry{0, _program});
+  else if (_parser._argv)
+    _entries.push_back(Entry{_parser._argv[0], ""});
+  else
+    _entries.push_back(Entry{0, _parser.prog()});
+
+  // new occurrences go after the last option given, so they are neither
+  // taken as positional arguments nor overridden by an earlier occurrence
+  const size_t insert_at = spans.empty() ? 0 : spans.back().end;
+  fextl::set<fextl::string> overridden;
+  size_t s = 0;
+  for (size_t i = 0; i <= n; ) {
+    if (i == insert_at) {
+      for (strMap::const_iterator it = _overrides.begin(); it != _overrides.end(); ++it) {
+        if (overridden.find(it->first) == overridden.end())
+          spell(it->first, it->second);
+      }
+      for (size_t a = 0; a < _appends.size(); ++a)
+        spell(_appends[a].first, _appends[a].second);
+    }
+    if (i == n)
+      break;
+
+    if (s == spans.size() or spans[s].first != i) {
+      _entries.push_back(_parser._argv ? Entry{_parser._argv[i+1], ""} : Entry{_parser._args[i].c_str(), ""});
+      ++i;
+      continue;
+    }
+
+    // all options of a short option cluster start at the same argument
+    size_t e = s, end = i;
+    bool touched = false;
+    for (; e < spans.size() and spans[e].first == i; ++e) {
+      const fextl::string& dest = spans[e].option->dest();
+      touched = touched or _removed.find(dest) != _removed.end() or _overrides.find(dest) != _overrides.end();
+      end = std::max(end, spans[e].end);
+    }
+    if (not touched) {
+      for (; i < end; ++i)
+        _entries.push_back(_parser._argv ? Entry{_parser._argv[i+1], ""} : Entry{_parser._args[i].c_str(), ""});
+    } else {
+      for (; s < e; ++s) {
+        const fextl::string& dest = spans[s].option->dest();
+        strMap::const_iterator o = _overrides.find(dest);
+        if (_removed.find(dest) != _removed.end())
+          continue;
+        else if (o == _overrides.end())
+          spell(spans[s].option, spans[s].opt, spans[s].value);
+        else if (overridden.insert(dest).second)
+          spell(dest, o->second);
+      }
+    }
+    s = e;
+    i = end;
+  }
+  for (size_t a = 0; a < _extra_args.size(); ++a)
+    _entries.push_back(Entry{0, _extra_args[a]});
+
+  // one buffer of pointers, so the table is aligned; the arguments that were
+  // rewritten are stored as chars after it, which may alias any object
+  _argc = _entries.size();
+  size_t bytes = 0;
+  for (size_t i = 0; i < _argc; ++i) {
+    if (not _entries[i].orig)
+      bytes += _entries[i].text.size() + 1;
+  }
+  _buffer.resize(_argc + 1 + (bytes + sizeof(char*) - 1) / sizeof(char*));
+  char** argv = _buffer.data();
+  char* str = reinterpret_cast<char*>(argv + _argc + 1);
+  for (size_t i = 0; i < _argc; ++i) {
+    if (_entries[i].orig) {
+      argv[i] = const_cast<char*>(_entries[i].orig);
+      continue;
+    }
+    memcpy(str, _entries[i].text.c_str(), _entries[i].text.size() + 1);
+    argv[i] = str;
+    str += _entries[i].text.size() + 1;
+  }
+  argv[_argc] = 0;
+  return argv;
+}
+////////// } class ArgvBuilder //////////
+
+
+#if defined(OPTPARSE_TRACE) && OPTPARSE_TRACE
+////////// namespace trace { //////////
+namespace trace {
+
+// Slot sequence numbers work like a seqlock: odd while record n is being
+// written, 2*(n+1) once it is complete, so readers never block writers.
+struct Slot {
+  std::atomic<uint64_t> seq;
+  std::atomic<uint32_t> phase;
+  std::atomic<uint32_t> tid;
+  std::atomic<uint64_t> begin_ns;
+  std::atomic<uint64_t> end_ns;
+};
+
+static Slot ring[RING_SIZE];
+static std::atomic<uint64_t> head;
+static std::atomic<uint64_t> base;
+static std::atomic<uint64_t> counts[NUM_PHASES];
+static std::atomic<uint64_t> totals[NUM_PHASES];
+static std::atomic<uint32_t> next_tid;
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+static uint32_t thread_id() {
+  static thread_local uint32_t tid = next_tid.fetch_add(1, std::memory_order_relaxed) + 1;
+  return tid;
+}
+static void push(Phase p, uint64_t begin, uint64_t end) {
+  uint64_t n = head.fetch_add(1, std::memory_order_relaxed);
+  Slot& s = ring[n % RING_SIZE];
+  s.seq.store(2*n + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  s.phase.store(p, std::memory_order_relaxed);
+  s.tid.store(thread_id(), std::memory_order_relaxed);
+  s.begin_ns.store(begin, std::memory_order_relaxed);
+  s.end_ns.store(end, std::memory_order_relaxed);
+  s.seq.store(2*n + 2, std::memory_order_release);
+
+  counts[p].fetch_add(1, std::memory_order_relaxed);
+  totals[p].fetch_add(end - begin, std::memory_order_relaxed);
+}
+
+const char* phase_name(Phase p) {
+  static const char* const names[NUM_PHASES] = {
+    "registration", "tokenize", "lookup", "type_check", "callback", "defaults", "help"
+  };
+  return (p < NUM_PHASES) ? names[p] : "unknown";
+}
+
+size_t records(Record* out, size_t max) {
+  uint64_t n = head.load(std::memory_order_acquire);
+  uint64_t first = base.load(std::memory_order_relaxed);
+  if (n - first > RING_SIZE)
+    first = n - RING_SIZE;
+  if (n - first > max)
+    first = n - max;
+
+  size_t copied = 0;
+  for (uint64_t i = first; i < n; ++i) {
+    const Slot& s = ring[i % RING_SIZE];
+    uint64_t seq = s.seq.load(std::memory_order_acquire);
+    if (seq != 2*i + 2)
+      continue;
+    Record r;
+    r.phase = static_cast<Phase>(s.phase.load(std::memory_order_relaxed));
+    r.tid = s.tid.load(std::memory_order_relaxed);
+    r.begin_ns = s.begin_ns.load(std::memory_order_relaxed);
+    r.end_ns = s.end_ns.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s.seq.load(std::memory_order_relaxed) != seq)
+      continue;
+    out[copied++] = r;
+  }
+  return copied;
+}
+
+Counter counter(Phase p) {
+  Counter c;
+  c.count = counts[p].load(std::memory_order_relaxed);
+  c.total_ns = totals[p].load(std::memory_order_relaxed);
+  return c;
+}
+
+void clear() {
+  base.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  for (size_t p = 0; p < NUM_PHASES; ++p) {
+    counts[p].store(0, std::memory_order_relaxed);
+    totals[p].store(0, std::memory_order_relaxed);
+  }
+}
+
+void write_chrome_trace(std::ostream& out) {
+  fextl::vector<Record> buf(RING_SIZE);
+  size_t n = records(&buf[0], buf.size());
+  char line[160];
+
+  out << "{\"traceEvents\":[";
+  for (size_t i = 0; i < n; ++i) {
+    const Record& r = buf[i];
+    uint64_t dur = r.end_ns - r.begin_ns;
+    snprintf(line, sizeof(line),
+      "%s\n{\"name\":\"%s\",\"cat\":\"optparse\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%llu.%03u,\"dur\":%llu.%03u}",
+      (i != 0) ? "," : "", phase_name(r.phase), static_cast<unsigned>(r.tid),
+      static_cast<unsigned long long>(r.begin_ns / 1000), static_cast<unsigned>(r.begin_ns % 1000),
+      static_cast<unsigned long long>(dur / 1000), static_cast<unsigned>(dur % 1000));
+    out << line;
+  }
+  out << "\n],\"displayTimeUnit\":\"ns\"}" << std::endl;
+}
+
+Scope::Scope(Phase p) : _phase(p), _begin(now_ns()), _open(true) {}
+void Scope::end() {
+  if (not _open)
+    return;
+  _open = false;
+  push(_phase, _begin, now_ns());
+}
+
+}
+////////// } namespace trace //////////
+#endif
+
 }
@@ -14,9 +14,21 @@
 #include <FEXCore/fextl/sstream.h>
 #include <FEXCore/fextl/vector.h>
 
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
 #include <map>
 #include <iostream>
+#include <limits>
 #include <optional>
+#include <type_traits>
+
+#if defined(OPTPARSE_TRACE) && OPTPARSE_TRACE
+# include <cstddef>
+# include <cstdint>
+#endif
 
 namespace optparse {
 
@@ -24,12 +36,22 @@ class OptionParser;
 class OptionGroup;
 class Option;
 class Values;
+class Snapshot;
 class Value;
 class Callback;
+class ChangeCallback;
+class Executor;
+class OptionDescriptor;
+class ArgvBuilder;
+class ArgSource;
+class ParseIterator;
+class EffectiveConfig;
+class SubcommandFactory;
 
 typedef fextl::map<fextl::string,fextl::string> strMap;
 typedef fextl::map<fextl::string,fextl::list<fextl::string> > lstMap;
 typedef fextl::map<fextl::string,Option const*> optMap;
+typedef fextl::map<fextl::string,SubcommandFactory*> cmdMap;
 
 const char* const SUPPRESS_HELP = "SUPPRESS" "HELP";
 const char* const SUPPRESS_USAGE = "SUPPRESS" "USAGE";
@@ -57,12 +79,23 @@ class Value {
 
 class Values {
   public:
+    static const size_t npos = static_cast<size_t>(-1);
+
     Values() : _map() {}
     std::optional<const fextl::string*> operator[] (const fextl::string& d) const;
     fextl::string& operator[] (const fextl::string& d) { return _map[d]; }
     bool is_set(const fextl::string& d) const { return _map.find(d) != _map.end(); }
     bool is_set_by_user(const fextl::string& d) const { return _userSet.find(d) != _userSet.end(); }
     void is_set_by_user(const fextl::string& d, bool yes);
+    //! Set from the environment variable of an option, see Option::env()
+    bool is_set_from_env(const fextl::string& d) const { return _envSet.find(d) != _envSet.end(); }
+    void is_set_from_env(const fextl::string& d, bool yes);
+    //! Filled in from the default of an option or OptionParser::set_defaults() after parsing
+    bool is_set_from_default(const fextl::string& d) const { return _defaultSet.find(d) != _defaultSet.end(); }
+    void is_set_from_default(const fextl::string& d, bool yes);
+    //! Position of the value of a choice option in its choices(), npos if not set
+    size_t choice(const fextl::string& d) const;
+    void choice(const fextl::string& d, size_t i) { _choiceMap[d] = i; }
     Value get(const fextl::string& d) const { return (is_set(d)) ? Value(*(*this)[d].value()) : Value(); }
 
     typedef fextl::list<fextl::string>::iterator iterator;
@@ -70,16 +103,107 @@ class Values {
     fextl::list<fextl::string>& all(const fextl::string& d) { return _appendMap[d]; }
     const fextl::list<fextl::string>& all(const fextl::string& d) const { return _appendMap.find(d)->second; }
 
+    //! Dests whose value, appended values or source differ from old
+    fextl::set<fextl::string> changed(const Values& old) const;
+
   private:
     strMap _map;
     lstMap _appendMap;
     fextl::set<fextl::string> _userSet;
+    fextl::set<fextl::string> _envSet;
+    fextl::set<fextl::string> _defaultSet;
+    fextl::map<fextl::string, size_t> _choiceMap;
+
+    friend class Snapshot;
+    friend class EffectiveConfig;
+};
+
+//! Immutable copy of Values with pre-converted values, safe to read from any number of threads
+class Snapshot {
+  public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    explicit Snapshot(const Values& v);
+
+    size_t size() const { return _dests.size(); }
+    //! Position of dest for the index based accessors, npos if not set; resolve once, read often
+    size_t index(const fextl::string& d) const;
+
+    bool is_set(const fextl::string& d) const { return index(d) != npos; }
+    bool is_set_by_user(const fextl::string& d) const { size_t i = index(d); return i != npos and _items[i].user; }
+    const fextl::string& get(const fextl::string& d) const { size_t i = index(d); return (i != npos) ? _strs[i] : _empty; }
+    long long get_int(const fextl::string& d) const { size_t i = index(d); return (i != npos) ? _items[i].i : 0; }
+    double get_float(const fextl::string& d) const { size_t i = index(d); return (i != npos) ? _items[i].d : 0; }
+    bool get_bool(const fextl::string& d) const { return get_int(d) != 0; }
+    const fextl::vector<fextl::string>& all(const fextl::string& d) const;
+
+    const fextl::string& dest(size_t i) const { return _dests[i]; }
+    bool is_set_by_user(size_t i) const { return _items[i].user; }
+    const fextl::string& get(size_t i) const { return _strs[i]; }
+    long long get_int(size_t i) const { return _items[i].i; }
+    double get_float(size_t i) const { return _items[i].d; }
+    bool get_bool(size_t i) const { return _items[i].i != 0; }
+
+  private:
+    struct Item {
+      long long i;
+      double d;
+      bool user;
+    };
+
+    fextl::vector<fextl::string> _dests; // sorted
+    fextl::vector<Item> _items;
+    fextl::vector<fextl::string> _strs;
+    fextl::map<fextl::string, fextl::vector<fextl::string> > _all;
+    fextl::string _empty;
+};
+
+//! Holds the current Snapshot; readers never block, publish() waits until the previous one is unused.
+//! Readers count themselves in one of several counters chosen per thread, so concurrent
+//! reads on different threads mostly touch different cache lines
+class SnapshotCell {
+  public:
+    class Reader {
+      public:
+        Reader(const SnapshotCell& c);
+        ~Reader() { _count->fetch_sub(1); }
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        const Snapshot* get() const { return _snapshot; }
+        const Snapshot& operator*() const { return *_snapshot; }
+        const Snapshot* operator->() const { return _snapshot; }
+      private:
+        std::atomic<unsigned long>* _count;
+        const Snapshot* _snapshot;
+    };
+
+    SnapshotCell();
+    ~SnapshotCell();
+    SnapshotCell(const SnapshotCell&) = delete;
+    SnapshotCell& operator=(const SnapshotCell&) = delete;
+
+    //! Freezes v and makes it the current snapshot; calls must not overlap
+    void publish(const Values& v);
+    //! Pins the current snapshot (null before the first publish()) while the Reader lives
+    Reader read() const { return Reader(*this); }
+
+  private:
+    static const unsigned int STRIPES = 8;
+    struct alignas(64) Counter {
+      std::atomic<unsigned long> n;
+    };
+
+    std::atomic<Snapshot*> _current;
+    mutable std::atomic<unsigned long> _epoch;
+    mutable Counter _readers[2][STRIPES];
 };
 
 class Option {
   public:
     Option(const OptionParser& p) :
-      _parser(p), _action("store"), _type("string"), _nargs(1), _callback(0) {}
+      _parser(p), _action_kind(ACTION_STORE), _type_kind(TYPE_STRING), _optional_value(false), _deferred(false),
+      _nargs(1), _callback(0), _on_change(0), _bind_target(0), _bind(0), _bind_reset(0), _action("store"), _type("string") {}
     virtual ~Option() {}
 
     Option& action(const fextl::string& a);
@@ -93,16 +217,27 @@ class Option {
     Option& set_const(const fextl::string& c) { _const = c; return *this; }
     template<typename InputIterator>
     Option& choices(InputIterator begin, InputIterator end) {
-      _choices.assign(begin, end); type("choice"); return *this;
+      _choices.assign(begin, end); index_choices(); type("choice"); return *this;
     }
 #if __cplusplus >= 201103L
     Option& choices(std::initializer_list<fextl::string> ilist) {
-      _choices.assign(ilist); type("choice"); return *this;
+      _choices.assign(ilist); index_choices(); type("choice"); return *this;
     }
 #endif
     Option& help(const fextl::string& h) { _help = h; return *this; }
     Option& metavar(const fextl::string& m) { _metavar = m; return *this; }
+    //! Environment variable used when the option is not given on the command line
+    Option& env(const fextl::string& e) { _env = e; return *this; }
     Option& callback(Callback& c) { _callback = &c; return *this; }
+    //! Called by OptionParser::reparse() when the value of dest changed
+    Option& on_change(ChangeCallback& c) { _on_change = &c; return *this; }
+    //! Runs the callback after parsing, concurrently with other deferred callbacks;
+    //! callbacks sharing a non-empty queue run one after another in argument order
+    Option& defer(const fextl::string& queue = "") { _deferred = true; _queue = queue; return *this; }
+    //! Writes the converted value of dest to *t whenever it is stored, and after parsing;
+    //! reparse() sets *t to T() when dest is no longer set
+    template<typename T>
+    Option& bind(T* t) { _bind_target = t; _bind = &bind_value<T>; _bind_reset = &reset_value<T>; return *this; }
 
     const fextl::string& action() const { return _action; }
     const fextl::string& type() const { return _type; }
@@ -111,34 +246,111 @@ class Option {
     size_t nargs() const { return _nargs; }
     const fextl::string& get_const() const { return _const; }
     const fextl::list<fextl::string>& choices() const { return _choices; }
+    //! Position of val in choices(), Values::npos if it is not one of them
+    size_t choice_index(const fextl::string& val) const;
     const fextl::string& help() const { return _help; }
     const fextl::string& metavar() const { return _metavar; }
+    const fextl::string& env() const { return _env; }
     Callback* callback() const { return _callback; }
+    ChangeCallback* on_change() const { return _on_change; }
+    bool deferred() const { return _deferred; }
+    const fextl::string& queue() const { return _queue; }
 
   private:
-    fextl::string check_type(const fextl::string& opt, const fextl::string& val) const;
+    fextl::string check_type(const fextl::string& opt, const fextl::string& val, size_t* choice = 0) const;
+    void index_choices();
     fextl::string format_option_help(unsigned int indent = 2) const;
-    fextl::string format_help(unsigned int indent = 2) const;
+    void format_help(fextl::string& out, unsigned int indent = 2) const;
+
+    enum ActionKind {
+      ACTION_STORE, ACTION_STORE_CONST, ACTION_STORE_TRUE, ACTION_STORE_FALSE, ACTION_APPEND,
+      ACTION_APPEND_CONST, ACTION_COUNT, ACTION_HELP, ACTION_VERSION, ACTION_CALLBACK, ACTION_STORE_BOOL, ACTION_OTHER
+    };
+    enum TypeKind {
+      TYPE_STRING, TYPE_INT, TYPE_FLOAT, TYPE_CHOICE, TYPE_COMPLEX, TYPE_NONE, TYPE_OTHER
+    };
 
     const OptionParser& _parser;
 
+    // read for every parsed option, so kept together at the front
+    unsigned char _action_kind;
+    unsigned char _type_kind;
+    bool _optional_value;
+    bool _deferred;
+    size_t _nargs;
+    Callback* _callback;
+    ChangeCallback* _on_change;
+    void* _bind_target;
+    bool (*_bind)(void* target, const fextl::string& val);
+    void (*_bind_reset)(void* target);
+
     fextl::set<fextl::string> _short_opts;
     fextl::set<fextl::string> _long_opts;
 
-    bool _optional_value;
     fextl::string _action;
     fextl::string _type;
     fextl::string _dest;
     fextl::string _default;
-    size_t _nargs;
     fextl::string _const;
     fextl::list<fextl::string> _choices;
+    fextl::vector<std::pair<fextl::string, unsigned int> > _choices_sorted; // values and positions, ordered by value
     fextl::string _help;
     fextl::string _metavar;
-    Callback* _callback;
+    fextl::string _env;
+    fextl::string _queue;
+
+    //! Converts val to T, rejecting trailing garbage and values out of the range of T
+    template<typename T>
+    static bool bind_value(void* target, const fextl::string& val) {
+      T& t = *static_cast<T*>(target);
+      const char* begin = val.c_str();
+      char* end;
+      errno = 0;
+      if constexpr (std::is_same<T, fextl::string>::value) {
+        t = val;
+        return true;
+      } else if constexpr (std::is_same<T, bool>::value) {
+        t = std::strtol(begin, &end, 10) != 0;
+        return val == "" or (end != begin and *end == '\0');
+      } else if constexpr (std::is_integral<T>::value && std::is_signed<T>::value) {
+        long long n = std::strtoll(begin, &end, 10);
+        if (end == begin or *end != '\0' or errno == ERANGE or
+            n < std::numeric_limits<T>::min() or n > std::numeric_limits<T>::max())
+          return false;
+        t = static_cast<T>(n);
+        return true;
+      } else if constexpr (std::is_integral<T>::value) {
+        // strtoull() negates a leading minus sign instead of failing
+        const char* first = begin;
+        while (std::isspace(static_cast<unsigned char>(*first)))
+          ++first;
+        if (*first == '-')
+          return false;
+        unsigned long long n = std::strtoull(begin, &end, 10);
+        if (end == begin or *end != '\0' or errno == ERANGE or n > std::numeric_limits<T>::max())
+          return false;
+        t = static_cast<T>(n);
+        return true;
+      } else if constexpr (std::is_floating_point<T>::value) {
+        long double n = std::strtold(begin, &end);
+        if (end == begin or *end != '\0')
+          return false;
+        // underflow still yields a usable value, overflow does not
+        if (std::isfinite(n) ? (std::fabs(n) > std::numeric_limits<T>::max()) : errno == ERANGE)
+          return false;
+        t = static_cast<T>(n);
+        return true;
+      } else {
+        fextl::istringstream ss(val);
+        return static_cast<bool>(ss >> t);
+      }
+    }
+    template<typename T>
+    static void reset_value(void* target) { *static_cast<T*>(target) = T(); }
 
     friend class OptionContainer;
     friend class OptionParser;
+    friend class ArgvBuilder;
 };
 
 class OptionContainer {
@@ -157,6 +369,8 @@ class OptionContainer {
     fextl::string format_option_help(unsigned int indent = 2) const;
 
   protected:
+    void format_option_help(fextl::string& out, unsigned int indent) const;
+
     fextl::string _description;
 
     fextl::list<Option> _opts;
@@ -187,6 +401,15 @@ class OptionParser : public OptionContainer {
     OptionParser& enable_interspersed_args() { _interspersed_args = true; return *this; }
     OptionParser& disable_interspersed_args() { _interspersed_args = false; return *this; }
     OptionParser& add_option_group(const OptionGroup& group);
+    //! Creates a group owned by the parser, e.g. in a SubcommandFactory; options can be
+    //! added to it after this call, they are registered when parsing starts
+    OptionGroup& add_option_group(const fextl::string& title, const fextl::string& description = "");
+    //! Adds all options declared with OPTPARSE_REGISTER, into groups by subsystem if groups is set
+    OptionParser& add_registered_options(bool groups = true);
+    OptionParser& add_subcommand(const fextl::string& name, SubcommandFactory& factory, const fextl::string& help = "");
+    //! Runs deferred callbacks on e instead of the parser's own threads
+    OptionParser& executor(Executor& e) { _executor = &e; return *this; }
+    OptionParser& callback_threads(unsigned int n) { _callback_threads = n; return *this; }
 
     const fextl::string& usage() const { return _usage; }
     const fextl::string& version() const { return _version; }
@@ -204,6 +427,17 @@ class OptionParser : public OptionContainer {
       return parse_args(fextl::vector<fextl::string>(begin, end));
     }
 
+    //! Parses new arguments against the same options, e.g. on reload; returns the changed dests.
+    //! If parsing fails and exit() returns by throwing, the previous values stay in place.
+    fextl::set<fextl::string> reparse(int argc, char const* const* argv);
+    fextl::set<fextl::string> reparse(const fextl::vector<fextl::string>& args);
+
+    //! Parses arguments one at a time as they are read from source, see ParseIterator;
+    //! source must live until the iterator is done. Arguments are dropped once they have
+    //! been yielded, so args() and parsed_args() stay empty, unless keep_args is set,
+    //! which ArgvBuilder needs
+    ParseIterator iterate(ArgSource& source, bool keep_args = false);
+
     const fextl::list<fextl::string>& args() const { return _leftover; }
     fextl::vector<fextl::string> args() {
       return fextl::vector<fextl::string>(_leftover.begin(), _leftover.end());
@@ -213,6 +447,12 @@ class OptionParser : public OptionContainer {
       return fextl::vector<fextl::string>(_parsed.begin(), _parsed.end());
     }
 
+    Values& values() { return _values; }
+    const Values& values() const { return _values; }
+
+    const fextl::string& subcommand() const { return _subcommand; }
+    OptionParser* subcommand_parser() { return _subparsers.empty() ? 0 : &_subparsers.front(); }
+
     fextl::string format_help() const;
     void print_help() const;
 
@@ -225,20 +465,45 @@ class OptionParser : public OptionContainer {
     void print_version(std::ostream& out) const;
     void print_version() const;
 
+    //! Prints msg and exits; in a deferred callback the first error is kept and reported after all have run
     void error(const fextl::string& msg) const;
-    void exit() const;
+    //! Same as error()
+    void callback_error(const fextl::string& msg) const;
+    virtual void exit() const;
 
   private:
     const OptionParser& get_parser() { return *this; }
-    const Option& lookup_short_opt(const fextl::string& opt) const;
-    const Option& lookup_long_opt(const fextl::string& opt) const;
+    //! arg is the whole cluster, for suggestions when opt is unknown
+    const Option& lookup_short_opt(const fextl::string& opt, const fextl::string& arg) const;
+    //! negated is set if opt is the "no-" form of a store_bool option
+    const Option& lookup_long_opt(const fextl::string& opt, bool* negated = 0) const;
+    fextl::string suggest_long_opt(const fextl::string& opt) const;
 
-    void handle_short_opt(const fextl::string& opt, const fextl::string& arg);
+    void handle_short_opt(const fextl::string& arg);
     void handle_long_opt(const fextl::string& optstr);
 
     void process_opt(const Option& option, const fextl::string& opt, const fextl::string& value);
+    void store_bound(const Option& option, const fextl::string& opt);
+    //! Writes all bound variables from the values, resetting those whose dest was only set in before
+    void rebind(const Values& before);
+
+    Values& parse_tokens(const fextl::vector<fextl::string>& args, char const* const* argv);
+    void begin_parse();
+    bool has_remaining();
+    bool handle_arg();
+    void finish_parse();
+    void index_group(const OptionGroup& group);
+    void build_lookup_tables();
+    void parse_subcommand();
+    class ReparseGuard;
+    void reset();
+    fextl::set<fextl::string> finish_reparse(ReparseGuard& guard);
+    void notify_changed(const fextl::set<fextl::string>& changed, const Values& old) const;
+    void process_env();
+    void run_deferred();
 
     fextl::string format_usage(const fextl::string& u) const;
+    void format_subcommand_help(fextl::string& out) const;
 
     fextl::string _usage;
     fextl::string _version;
@@ -252,12 +517,62 @@ class OptionParser : public OptionContainer {
 
     strMap _defaults;
     fextl::list<OptionGroup const*> _groups;
+    fextl::list<OptionGroup> _owned_groups;
 
     fextl::list<fextl::string> _remaining;
     fextl::list<fextl::string> _leftover;
     fextl::list<fextl::string> _parsed;
 
+    // where each option occurrence was found in the arguments, for ArgvBuilder;
+    // the arguments are argv[1..] if parsed from argv, otherwise _args
+    struct ArgSpan {
+      Option const* option;
+      fextl::string opt;
+      fextl::string value;
+      size_t first;
+      size_t end;
+    };
+    fextl::vector<ArgSpan> _arg_spans;
+    char const* const* _argv;
+    fextl::vector<fextl::string> _args;
+    size_t _arg_count;
+    ArgSource* _source;
+    bool _keep_args;
+
+    // contiguous copies of _optmap_l/_optmap_s for lookups, rebuilt by parse_args()
+    fextl::vector<fextl::string> _long_names;
+    fextl::vector<Option const*> _long_table;
+    // long names of store_bool options, which also match with a "no-" prefix
+    fextl::vector<fextl::string> _neg_names;
+    fextl::vector<Option const*> _neg_table;
+    // the first option of each dest in schema order, and their positions ordered by dest
+    fextl::vector<Option const*> _dest_options;
+    fextl::vector<unsigned int> _dest_sorted;
+    fextl::vector<Option const*> _bound_options;
+    Option const* _short_table[256];
+
+    cmdMap _subcommands;
+    strMap _subcommand_help;
+    fextl::list<fextl::string> _subcommand_names;
+    fextl::string _subcommand;
+    fextl::list<OptionParser> _subparsers;
+    OptionParser const* _parent;
+
+    struct DeferredCall {
+      Option const* option;
+      fextl::string opt;
+      fextl::string value;
+      fextl::string error;
+    };
+    fextl::vector<DeferredCall> _deferred_calls;
+    Executor* _executor;
+    unsigned int _callback_threads;
+
     friend class Option;
+    friend class DeferredTask;
+    friend class ArgvBuilder;
+    friend class ParseIterator;
+    friend class EffectiveConfig;
 };
 
 class OptionGroup : public OptionContainer {
@@ -276,6 +591,138 @@ class OptionGroup : public OptionContainer {
     fextl::string _title;
 
   friend class OptionParser;
+  friend class ArgvBuilder;
+};
+
+//! Arguments for OptionParser::iterate(), read as they are needed
+class ArgSource {
+public:
+  //! Stores the next argument in arg, returns false at the end of the input
+  virtual bool next(fextl::string& arg) = 0;
+  virtual ~ArgSource() {}
+};
+
+//! Reads one argument per line, or per delim, e.g. '\0' for the output of find -print0
+class StreamArgSource : public ArgSource {
+public:
+  StreamArgSource(std::istream& in, char delim = '\n') : _in(in), _delim(delim) {}
+  bool next(fextl::string& arg) { return static_cast<bool>(std::getline(_in, arg, _delim)); }
+
+private:
+  std::istream& _in;
+  const char _delim;
+};
+
+struct ParseEvent {
+  enum Kind { OPTION, POSITIONAL, TERMINATOR };
+  Kind kind;
+  //! For OPTION events, the option and the name it was given as
+  Option const* option;
+  fextl::string opt;
+  //! The value of the option, or the positional argument
+  fextl::string value;
+};
+
+//! Pulls one event at a time from OptionParser::iterate(); values are stored as
+//! they are parsed, defaults, environment variables and deferred callbacks
+//! follow when the source is exhausted, like at the end of parse_args()
+class ParseIterator {
+  public:
+    //! Parses up to the next event; false once the source is exhausted and parsing is complete
+    bool next(ParseEvent& e);
+    bool done() const { return _done; }
+
+  private:
+    ParseIterator(OptionParser& p) : _parser(p), _span(0), _rest(false), _done(false) {}
+    void release();
+
+    OptionParser& _parser;
+    size_t _span;
+    bool _rest; // after "--" or the first positional without interspersed args
+    bool _done;
+
+    friend class OptionParser;
+};
+
+//! Builds an argv for execve()/posix_spawn() from the arguments the parser was given
+//! and edits by dest; unchanged arguments point at the original argv storage.
+//! After OptionParser::iterate(), the arguments are only there with keep_args
+class ArgvBuilder {
+  public:
+    ArgvBuilder(const OptionParser& p) : _parser(p), _has_program(false), _argc(0) {}
+
+    //! argv[0], by default the one given to parse_args() or else prog()
+    ArgvBuilder& program(const fextl::string& p) { _program = p; _has_program = true; return *this; }
+    //! Drops all occurrences of options storing to dest
+    ArgvBuilder& remove(const fextl::string& dest);
+    //! Replaces all occurrences of options storing to dest by one, at the first occurrence
+    ArgvBuilder& set(const fextl::string& dest, const fextl::string& value = "");
+    //! Adds an occurrence after the last option given
+    ArgvBuilder& append(const fextl::string& dest, const fextl::string& value = "");
+    //! Adds a positional argument at the end
+    ArgvBuilder& append_arg(const fextl::string& arg) { _extra_args.push_back(arg); return *this; }
+
+    //! Returns the NUL-terminated argv, valid until the builder or the parser changes
+    char* const* build();
+    size_t size() const { return _argc; }
+
+  private:
+    struct Entry {
+      const char* orig;
+      fextl::string text;
+    };
+
+    Option const* find_option(const fextl::string& dest, bool value) const;
+    void spell(Option const* option, const fextl::string& opt, const fextl::string& value);
+    void spell(const fextl::string& dest, const fextl::string& value);
+
+    const OptionParser& _parser;
+    fextl::string _program;
+    bool _has_program;
+    fextl::set<fextl::string> _removed;
+    strMap _overrides;
+    fextl::vector<std::pair<fextl::string, fextl::string> > _appends;
+    fextl::vector<fextl::string> _extra_args;
+
+    fextl::vector<Entry> _entries;
+    fextl::vector<char*> _buffer; // the pointer table, then the rewritten arguments
+    size_t _argc;
+};
+
+//! The value and provenance of every dest, in schema order; dests that were
+//! stored without an option (e.g. by a callback) follow in alphabetical order
+class EffectiveConfig {
+  public:
+    //! PROGRAM is a value stored through OptionParser::values() rather than by parsing
+    enum Source { UNSET, DEFAULT, SET_DEFAULTS, ENVIRONMENT, USER, PROGRAM };
+    struct Item {
+      const fextl::string* dest;
+      //! Null if unset
+      const fextl::string* value;
+      //! Every value of an append option, null for other options
+      const fextl::list<fextl::string>* all;
+      //! Null for dests without an option
+      Option const* option;
+      Source source;
+    };
+    typedef fextl::vector<Item>::const_iterator const_iterator;
+
+    //! Collects the items in a single pass over the parser's values
+    EffectiveConfig(const OptionParser& p);
+
+    size_t size() const { return _items.size(); }
+    const Item& operator[] (size_t i) const { return _items[i]; }
+    const_iterator begin() const { return _items.begin(); }
+    const_iterator end() const { return _items.end(); }
+
+    static const char* source_name(Source s);
+    //! Appends {"dest":{"value":...,"source":"..."},...}, appended values as arrays
+    void write_json(fextl::string& out) const;
+    //! Appends one "source dest=value" line per value, escaping \\ and newlines
+    void write_lines(fextl::string& out) const;
+
+  private:
+    fextl::vector<Item> _items;
 };
 
 class Callback {
@@ -284,6 +731,147 @@ public:
   virtual ~Callback() {}
 };
 
+class Task {
+public:
+  virtual void operator() () = 0;
+  virtual ~Task() {}
+};
+
+//! Runs deferred callbacks; submit() may run the task right away or on any thread
+class Executor {
+public:
+  virtual void submit(Task& task) = 0;
+  //! Returns once all submitted tasks have finished
+  virtual void wait() = 0;
+  virtual ~Executor() {}
+};
+
+class ChangeCallback {
+public:
+  virtual void operator() (const fextl::string& dest, const Values& old, const Values& values, const OptionParser& parser) = 0;
+  virtual ~ChangeCallback() {}
+};
+
+//! Builds the parser of a subcommand; only invoked for the subcommand actually given
+class SubcommandFactory {
+public:
+  virtual void operator() (OptionParser& parser) = 0;
+  virtual ~SubcommandFactory() {}
+};
+
+//! Option declaration that can be constant-initialized, see OPTPARSE_REGISTER
+class OptionDescriptor {
+  public:
+    constexpr OptionDescriptor(const char* opt1, const char* opt2 = 0) :
+      _opt1(opt1), _opt2(opt2), _action(0), _type(0), _dest(0), _default(0), _help(0), _metavar(0), _group(0),
+      _file(""), _order(0) {}
+
+    constexpr OptionDescriptor action(const char* a) const { OptionDescriptor d = *this; d._action = a; return d; }
+    constexpr OptionDescriptor type(const char* t) const { OptionDescriptor d = *this; d._type = t; return d; }
+    constexpr OptionDescriptor dest(const char* n) const { OptionDescriptor d = *this; d._dest = n; return d; }
+    constexpr OptionDescriptor set_default(const char* v) const { OptionDescriptor d = *this; d._default = v; return d; }
+    constexpr OptionDescriptor help(const char* h) const { OptionDescriptor d = *this; d._help = h; return d; }
+    constexpr OptionDescriptor metavar(const char* m) const { OptionDescriptor d = *this; d._metavar = m; return d; }
+    //! Subsystem, becomes the title of the OptionGroup the option is placed in
+    constexpr OptionDescriptor group(const char* g) const { OptionDescriptor d = *this; d._group = g; return d; }
+    //! Position of the declaration, set by OPTPARSE_REGISTER
+    constexpr OptionDescriptor registered(const char* file, unsigned int order) const {
+      OptionDescriptor d = *this; d._file = file; d._order = order; return d;
+    }
+
+  private:
+    const char* _opt1;
+    const char* _opt2;
+    const char* _action;
+    const char* _type;
+    const char* _dest;
+    const char* _default;
+    const char* _help;
+    const char* _metavar;
+    const char* _group;
+    const char* _file;
+    unsigned int _order;
+
+    friend class OptionParser;
+};
+
+}
+
+// Registered descriptors are collected by the linker into one section, so
+// there is no static initializer and no registration code per translation
+// unit. The linker may place them in any order, so options are sorted by
+// file name, then by declaration order within the file. The explicit
+// alignment keeps the compiler from padding the entries.
+// Only available with ELF linkers; an object file whose symbols are
+// not otherwise referenced is not pulled out of a static library.
+#if defined(__ELF__)
+# if defined(__has_attribute)
+#  if __has_attribute(retain)
+#   define OPTPARSE_RETAIN , retain
+#  endif
+# endif
+# ifndef OPTPARSE_RETAIN
+#  define OPTPARSE_RETAIN
+# endif
+# define OPTPARSE_REGISTER(name, descriptor) \
+  __attribute__((used OPTPARSE_RETAIN, section("optparse_registry"), aligned(alignof(::optparse::OptionDescriptor)))) \
+  constexpr ::optparse::OptionDescriptor optparse_registered_##name = (descriptor).registered(__FILE__, __COUNTER__)
+#endif
+
+namespace optparse {
+
+#if defined(OPTPARSE_TRACE) && OPTPARSE_TRACE
+//! Per-phase parse tracing, only compiled in with OPTPARSE_TRACE=1
+namespace trace {
+
+enum Phase {
+  REGISTRATION,
+  TOKENIZE,
+  LOOKUP,
+  TYPE_CHECK,
+  CALLBACK,
+  DEFAULTS,
+  HELP,
+  NUM_PHASES
+};
+
+struct Record {
+  Phase phase;
+  uint32_t tid;
+  uint64_t begin_ns;
+  uint64_t end_ns;
+};
+
+struct Counter {
+  uint64_t count;
+  uint64_t total_ns;
+};
+
+//! Capacity of the ring buffer; older records are overwritten
+const size_t RING_SIZE = 4096;
+
+const char* phase_name(Phase p);
+//! Copies up to max of the most recent records, oldest first; returns the number copied
+size_t records(Record* out, size_t max);
+Counter counter(Phase p);
+void clear();
+//! Writes the buffered records in Chrome trace event format (chrome://tracing, Perfetto)
+void write_chrome_trace(std::ostream& out);
+
+class Scope {
+  public:
+    explicit Scope(Phase p);
+    ~Scope() { end(); }
+    void end();
+  private:
+    Phase _phase;
+    uint64_t _begin;
+    bool _open;
+};
+
+}
+#endif
+
 }
 
 #endif
@@ -0,0 +1,61 @@
+#!/bin/bash
+# -*- mode: sh; coding: utf-8; indent-tabs-mode: nil -*-
+# vim: set filetype=sh fileencoding=utf-8 expandtab sw=4 sts=4:
+
+# Reports the startup footprint of the parser as key=value lines, so that
+# runs on different commits can be compared with diff.
+#   object.*   sections of OptionParser.o, static_init = .init_array entries
+#   testprog.* / schema.*  mean wall-clock time per exec (us) over ITERATIONS
+#   schema.first_value_us ...  medians of in-process figures from footprint_schema
+
+ITERATIONS=${ITERATIONS:-200}
+SCHEMA_ARGS=(--option-0 --option-1 7 --option-999 x --option-2=0.5 pos)
+
+export COLUMNS=80
+
+for f in OptionParser.o testprog footprint_schema ; do
+    if [[ ! -e $f ]] ; then
+        echo >&2 "$f missing, run: make footprint"
+        exit 1
+    fi
+done
+
+# sections are summed per kind, C++ puts inline functions into .text.<name> etc.
+size -A OptionParser.o | awk '
+    $1 ~ /^\.(text|data|bss|rodata)($|\.)/ { split($1, s, "."); sum[s[2]] += $2 }
+    $1 == ".init_array" { init = $2 / 8 }
+    END {
+        print "object.text=" sum["text"] + 0
+        print "object.rodata=" sum["rodata"] + 0
+        print "object.data=" sum["data"] + 0
+        print "object.bss=" sum["bss"] + 0
+        print "object.static_init=" init + 0
+    }'
+
+exec_us () {
+    local start end i
+    start=$(date +%s%N)
+    for (( i = 0 ; i < ITERATIONS ; i++ )) ; do
+        "$@" >/dev/null 2>&1
+    done
+    end=$(date +%s%N)
+    echo $(( (end - start) / ITERATIONS / 1000 ))
+}
+
+echo "testprog.exec_us=$(exec_us ./testprog foo -k -n 3 --string bar)"
+echo "schema.exec_us=$(exec_us ./footprint_schema "${SCHEMA_ARGS[@]}")"
+
+# median over ITERATIONS runs of each in-process figure
+for (( i = 0 ; i < ITERATIONS ; i++ )) ; do
+    ./footprint_schema "${SCHEMA_ARGS[@]}" 2>&1 >/dev/null
+done | awk '
+    { for (i = 1; i <= NF; i++) { split($i, kv, "="); if (kv[1] != "value") v[kv[1], NR] = kv[2]; keys[kv[1]] = 1 } }
+    END {
+        for (k in keys) {
+            if (k == "value") continue
+            n = 0
+            for (r = 1; r <= NR; r++) a[++n] = v[k, r] + 0
+            for (x = 2; x <= n; x++) for (y = x; y > 1 && a[y-1] > a[y]; y--) { t = a[y]; a[y] = a[y-1]; a[y-1] = t }
+            print "schema." k "=" a[int((n + 1) / 2)]
+        }
+    }' | sort
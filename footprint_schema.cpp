@@ -0,0 +1,59 @@
+/**
+ * Synthetic large-schema program for footprint.sh.
+ *
+ * Registers SCHEMA_OPTIONS options spread over SCHEMA_GROUPS groups, parses
+ * its arguments, reads one value and reports on stderr how long that took
+ * since main() was entered, together with the page faults and resident set
+ * size of the process at that point.
+ */
+
+#include "OptionParser.h"
+
+#include <chrono>
+#include <cstdio>
+#include <sys/resource.h>
+
+using namespace optparse;
+
+static const int SCHEMA_OPTIONS = 1000;
+static const int SCHEMA_GROUPS = 10;
+
+int main(int argc, char* argv[])
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  OptionParser parser = OptionParser() .description("synthetic large schema");
+  fextl::list<OptionGroup> groups;
+  for (int g = 0; g < SCHEMA_GROUPS; ++g) {
+    fextl::ostringstream title;
+    title << "Group " << g;
+    groups.push_back(OptionGroup(parser, title.str(), "Options of a synthetic subsystem."));
+  }
+
+  int n = 0;
+  for (fextl::list<OptionGroup>::iterator git = groups.begin(); git != groups.end(); ++git) {
+    for (int i = 0; i < SCHEMA_OPTIONS / SCHEMA_GROUPS; ++i, ++n) {
+      fextl::ostringstream name;
+      name << "--option-" << n;
+      switch (n % 4) {
+        case 0: git->add_option(name.str()) .action("store_true") .help("toggle"); break;
+        case 1: git->add_option(name.str()) .type("int") .set_default(n) .help("number (default: %default)"); break;
+        case 2: git->add_option(name.str()) .type("float") .help("ratio"); break;
+        default: git->add_option(name.str()) .help("text") .metavar("TEXT"); break;
+      }
+    }
+    parser.add_option_group(*git);
+  }
+
+  Values& options = parser.parse_args(argc, argv);
+  int first = options.get("option_1");
+
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  fprintf(stderr, "first_value_us=%lld minflt=%ld majflt=%ld maxrss_kb=%ld value=%d\n",
+    static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()),
+    ru.ru_minflt, ru.ru_majflt, ru.ru_maxrss, first);
+
+  return 0;
+}
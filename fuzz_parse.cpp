@@ -0,0 +1,230 @@
+/**
+ * Performance fuzzer for OptionParser.
+ *
+ * Each input selects a generated schema (first byte) and an argument list
+ * (remaining bytes, one argument per line). Parsing it and formatting the
+ * help output is timed while the input is scaled up by factors of SCALE,
+ * either by repeating the argument list or by stretching each argument; if
+ * the cost per byte of the last step grows by more than MAX_GROWTH the input
+ * is reported as superlinear.
+ *
+ * Build with -DFUZZ_LIBFUZZER and -fsanitize=fuzzer for libFuzzer, otherwise
+ * a standalone driver is built that checks the files given on the command
+ * line (e.g. the regression corpus in t/fuzz_corpus) and, with -n N, N
+ * pseudo-random inputs.
+ */
+
+#include "OptionParser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <streambuf>
+
+using namespace optparse;
+
+static const size_t SCALE = 8;
+static const double MAX_GROWTH = 4.0;
+static const double MIN_NS = 2e6; // ignore costs below timer noise
+static const double MAX_NS = 5e7; // stop scaling once this slow
+static const size_t MAX_BYTES = 1 << 18;
+
+class FuzzParser : public OptionParser {
+public:
+  void exit() const { throw 1; }
+};
+
+class NullBuffer : public std::streambuf {
+protected:
+  int overflow(int c) { return c; }
+};
+
+class FuzzCallback : public Callback {
+public:
+  void operator() (const Option&, const fextl::string&, const fextl::string&, const OptionParser&) {}
+};
+
+struct Input {
+  unsigned int schema;
+  fextl::vector<fextl::string> args;
+  fextl::string text;
+};
+
+//! Scales the input by repeating the argument list, or with stretch by repeating each argument's body
+static Input split_input(const uint8_t* data, size_t size, size_t repeat, bool stretch) {
+  Input in;
+  in.schema = size ? data[0] : 0;
+  fextl::vector<fextl::string> once;
+  fextl::string cur;
+  for (size_t i = 1; i < size; ++i) {
+    if (data[i] == '\n') {
+      once.push_back(cur);
+      cur.clear();
+    } else
+      cur += static_cast<char>(data[i]);
+  }
+  if (cur != "")
+    once.push_back(cur);
+  if (stretch) {
+    for (size_t i = 0; i < once.size(); ++i) {
+      if (once[i].empty())
+        continue;
+      fextl::string arg = once[i].substr(0, 1);
+      for (size_t r = 0; r < repeat; ++r)
+        arg += once[i].substr(1);
+      in.args.push_back(arg);
+      in.text += arg + " ";
+    }
+    return in;
+  }
+  for (size_t r = 0; r < repeat; ++r) {
+    in.args.insert(in.args.end(), once.begin(), once.end());
+    for (size_t i = 0; i < once.size(); ++i)
+      in.text += once[i] + " ";
+  }
+  return in;
+}
+
+static void build_schema(OptionParser& parser, unsigned int schema, const fextl::string& text) {
+  static FuzzCallback cb;
+  const size_t nlong = 4 + schema % 64;
+  char const* const choices[] = { "alpha", "beta", "gamma", "delta", "alphabet", "betamax" };
+
+  parser.prog("fuzz").add_help_option(false).add_version_option(false);
+  if (schema & 0x40)
+    parser.disable_interspersed_args();
+  parser.description(text).epilog(text);
+
+  for (char c = 'a'; c <= 'z'; ++c) {
+    fextl::string s = fextl::string("-") + c;
+    switch (c % 4) {
+      case 0: parser.add_option(s) .action("count"); break;
+      case 1: parser.add_option(s) .action("store_true"); break;
+      case 2: parser.add_option(s) .action("append"); break;
+      default: parser.add_option(s) .type("int") .set_default(0) .help("%default %default " + text); break;
+    }
+  }
+  for (size_t i = 0; i < nlong; ++i) {
+    fextl::ostringstream ss;
+    ss << "--opt" << fextl::string(i % 8, 'x') << "-" << i;
+    Option& o = parser.add_option(ss.str());
+    if (i % 3 == 0)
+      o.action("store_true");
+    else if (i % 3 == 1)
+      o.type("float");
+    else
+      o.help(text);
+  }
+  parser.add_option("-C", "--choice") .choices(&choices[0], &choices[6]);
+  parser.add_option("-K", "--callback") .action("callback") .callback(cb);
+}
+
+static double run_once(const Input& in) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  FuzzParser parser;
+  build_schema(parser, in.schema, in.text);
+  try {
+    parser.parse_args(in.args);
+  }
+  catch (int) {
+  }
+  parser.format_help();
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+static double cost(const uint8_t* data, size_t size, size_t repeat, bool stretch) {
+  const Input in = split_input(data, size, repeat, stretch);
+  double best = run_once(in);
+  for (int i = 0; i < 2; ++i) {
+    double t = run_once(in);
+    if (t < best)
+      best = t;
+  }
+  return best;
+}
+
+//! Returns the growth of the per-byte cost when the input is scaled, 0 if it stays below the noise floor
+static double scaled_growth(const uint8_t* data, size_t size, bool stretch) {
+  size_t repeat = 1;
+  double small = cost(data, size, repeat, stretch);
+  double large = cost(data, size, repeat * SCALE, stretch);
+  while (large < MAX_NS and repeat * SCALE * SCALE * size <= MAX_BYTES) {
+    repeat *= SCALE;
+    small = large;
+    large = cost(data, size, repeat * SCALE, stretch);
+  }
+  if (large < MIN_NS)
+    return 0;
+  return (large / SCALE) / (small > 0 ? small : 1);
+}
+
+static double superlinear_growth(const uint8_t* data, size_t size) {
+  if (size < 2)
+    return 0;
+  std::streambuf* err = std::cerr.rdbuf();
+  NullBuffer null;
+  std::cerr.rdbuf(&null);
+  double growth = std::max(scaled_growth(data, size, false), scaled_growth(data, size, true));
+  std::cerr.rdbuf(err);
+  return growth;
+}
+
+#ifdef FUZZ_LIBFUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  double growth = superlinear_growth(data, size);
+  if (growth > MAX_GROWTH) {
+    fprintf(stderr, "superlinear input: per-byte cost grows %.1fx when scaled %zux\n", growth, SCALE);
+    abort();
+  }
+  return 0;
+}
+#else
+static bool check(const fextl::string& name, const fextl::string& data, bool verbose) {
+  double growth = superlinear_growth(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+  bool ok = growth <= MAX_GROWTH;
+  if (verbose or not ok)
+    printf("%s %s: growth %.2f\n", ok ? "ok  " : "FAIL", name.c_str(), growth);
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  bool ok = true;
+  unsigned long iterations = 0;
+  uint32_t seed = 1;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-n") == 0 and i+1 < argc) {
+      iterations = strtoul(argv[++i], 0, 10);
+      continue;
+    }
+    std::ifstream f(argv[i], std::ios::binary);
+    if (not f) {
+      fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[i]);
+      return EXIT_FAILURE;
+    }
+    fextl::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    ok = check(argv[i], data, true) and ok;
+  }
+
+  for (unsigned long n = 0; n < iterations; ++n) {
+    fextl::string data;
+    size_t len = 1 + (seed >> 16) % 4096;
+    char const* const alphabet = "-=abckKxC\n-opt-xxx0123456789%default ";
+    for (size_t i = 0; i < len; ++i) {
+      seed = seed * 1103515245 + 12345;
+      data += alphabet[(seed >> 16) % strlen(alphabet)];
+    }
+    fextl::ostringstream name;
+    name << "random#" << n;
+    ok = check(name.str(), data, false) and ok;
+  }
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
@@ -4,6 +4,20 @@
 
 export COLUMNS=80
 
+# compares ./testext, which covers features Python's optparse does not have,
+# against the expected output: stdout and stderr, then the exit status
+x () {
+    local expected=$1
+    shift
+    echo "$(printf "%q " ./testext "$@")"
+    local actual
+    actual=$(./testext "$@" 2>&1 ; echo "status: $?")
+    if [[ "$actual" != "$expected" ]] ; then
+        diff -au <(echo "$expected") <(echo "$actual")
+        exit 1
+    fi
+}
+
 c () {
     echo "$(printf "%q " ./testprog "$@")"
     local t_stdout_cpp=$(mktemp -t cpp-stdout-optparse.XXXXXXXXXX)
@@ -85,3 +99,412 @@ c --no-clear foo bar -k -k z -v -n3 "x y" -i 8 -f 3.2 -c 2
 DISABLE_INTERSPERSED_ARGS=1 c -k a -k b
 DISABLE_USAGE=1 c --argument-does-not-exist
 DISABLE_USAGE=1 c --help
+
+# subcommands
+x "verbose: false
+command: build
+jobs: 4
+output: out
+arg: x
+status: 0" subcommand build -j 4 -o out x
+x "verbose: true
+command: clean
+all: true
+status: 0" subcommand -v clean --all
+x "verbose: false
+command: 
+status: 0" subcommand
+x "Usage: subcommand [options] <command> [args]
+
+subcommand: error: no such command: bogus
+status: 3" subcommand bogus
+x "Usage: subcommand build [options]
+
+subcommand build: error: no such option: --nope
+status: 3" subcommand build --nope
+x "Usage: subcommand [options] <command> [args]
+
+Options:
+  -h, --help            show this help message and exit
+  -v, --verbose         be verbose
+
+Commands:
+  build                 Build the project.
+  clean                 Remove build results.
+status: 0" subcommand -h
+x "Usage: subcommand build [options]
+
+Build the project.
+
+Options:
+  -h, --help            show this help message and exit
+  -j JOBS, --jobs=JOBS  parallel jobs (default: 1)
+
+  Output Options:
+    -o DIR, --output=DIR
+                        output directory
+status: 0" subcommand build -h
+
+# bound variables
+x "int: -7
+unsigned: 18446744073709551615
+long-long: -9223372036854775808
+float: 0
+bool: true
+status: 0" bind --int -7 --unsigned 18446744073709551615 --long-long -9223372036854775808 --float 1e-50 --bool 1
+x "Usage: bind [options]
+
+bind: error: option --unsigned: invalid value: '-1'
+status: 3" bind --unsigned -1
+x "Usage: bind [options]
+
+bind: error: option --unsigned: invalid value: ' -1'
+status: 3" bind --unsigned \ -1
+x "Usage: bind [options]
+
+bind: error: option --long-long: invalid value: '9223372036854775808'
+status: 3" bind --long-long 9223372036854775808
+x "Usage: bind [options]
+
+bind: error: option --int: invalid value: '2147483648'
+status: 3" bind --int 2147483648
+x "Usage: bind [options]
+
+bind: error: option --int: invalid value: '7x'
+status: 3" bind --int 7x
+x "Usage: bind [options]
+
+bind: error: option --float: invalid value: '1e39'
+status: 3" bind --float 1e39
+x "Usage: bind [options]
+
+bind: error: option --bool: invalid value: 'yes'
+status: 3" bind --bool yes
+x "Usage: bind [options]
+
+bind: error: option --unsigned: invalid value: '
+-1'
+status: 3" bind --unsigned $'\n-1'
+
+# environment variables
+x "width: 80 (default)
+fast: false (unset)
+name:  (default)
+color: 1 (default)
+status: 0" env
+TESTEXT_WIDTH= x "width: 80 (default)
+fast: false (unset)
+name:  (default)
+color: 1 (default)
+status: 0" env
+TESTEXT_WIDTH=132 TESTEXT_FAST=1 TESTEXT_NAME=x x "width: 132 (environment)
+fast: true (environment)
+name: x (environment)
+color: 1 (default)
+status: 0" env
+TESTEXT_FAST=0 TESTEXT_NAME= x "width: 80 (default)
+fast: false (unset)
+name:  (default)
+color: 1 (default)
+status: 0" env
+TESTEXT_WIDTH=abc x "Usage: env [options]
+
+env: error: option \$TESTEXT_WIDTH: invalid integer value: 'abc'
+status: 3" env
+TESTEXT_WIDTH=132 TESTEXT_FAST=1 x "width: 100 (user)
+fast: true (environment)
+name:  (default)
+color: 1 (default)
+status: 0" env -w 100
+TESTEXT_COLOR= x "width: 80 (default)
+fast: false (unset)
+name:  (default)
+color: 1 (default)
+status: 0" env
+TESTEXT_COLOR=0 x "width: 80 (default)
+fast: false (unset)
+name:  (default)
+color: 0 (environment)
+status: 0" env
+TESTEXT_COLOR=yes x "width: 80 (default)
+fast: false (unset)
+name:  (default)
+color: 1 (environment)
+status: 0" env
+
+# reparse
+x "changed width: 7 -> (unset)
+changed mode: (unset) -> x
+dest: mode
+dest: width
+width: (unset), bound: 0
+mode: x
+status: 0" reparse -w 7 / -m x
+x "changed mode: x -> y
+dest: mode
+width: 7, bound: 7
+mode: y
+status: 0" reparse -w 7 -m x / -w 7 -m y
+x "changed width: (unset) -> 9
+changed mode: x -> (unset)
+dest: mode
+dest: width
+width: 9, bound: 9
+mode: (unset)
+status: 0" reparse -m x / -w 9
+x "Usage: reparse [options]
+
+reparse: error: option -w: invalid integer value: 'abc'
+width: 7, bound: 7
+mode: x
+status: 3" reparse -w 7 -m x / -w abc
+x "width: 7, bound: 7
+mode: (unset)
+status: 0" reparse -w 7 / -w 7
+
+# deferred callbacks
+x "all checks passed
+status: 0" defer -c a -c b
+x "Usage: defer [options]
+
+defer: error: option -c: check failed for 'bad'; option -c: check failed for 'bad'
+status: 3" defer -c a -c bad -c b -c bad
+x "loaded lvl: 3
+all checks passed
+status: 0" defer --load --lvl=3
+x "Usage: load [options]
+
+load: error: no such option: -x
+Usage: defer [options]
+
+defer: error: option --load: cannot load '-x'
+status: 3" defer --load -x
+x "loaded lvl: 3
+Usage: defer [options]
+
+defer: error: option -c: check failed for 'bad'
+status: 3" defer --load --lvl=3 -c bad
+
+# registered options, only collected by ELF linkers
+if [[ "$(uname)" != Darwin ]] ; then
+x "Usage: registry [options]
+
+Options:
+  -h, --help            show this help message and exit
+  -r RETRIES, --retries=RETRIES
+                        retry count
+  --dump                print the configuration
+
+  Display:
+    --zoom=ZOOM         zoom level
+    --alpha             blend layers
+
+  Network:
+    --proxy=URL         proxy server
+status: 0" registry -h
+x "zoom: 50
+retries: 3
+proxy: p
+alpha: true
+dump_config: true
+status: 0" registry --zoom 50 -r 3 --alpha --dump --proxy p
+fi
+
+# argv builder
+x "[prog]
+[-v]
+[-j]
+[2]
+[file]
+status: 0" argv / -v -j 2 file
+x "[prog]
+[-v]
+[--jobs=8]
+[-k]
+[file]
+status: 0" argv set:jobs=8 / -vj2 -k file
+x "[prog]
+[-k]
+[-j]
+[2]
+[file]
+status: 0" argv remove:verbose / -vkq -j 2 --verbose file
+x "[prog]
+[-D]
+[A]
+[--verbose]
+[--define=B]
+[--]
+[-x]
+status: 0" argv append:define=B set:verbose / -D A -- -x
+x "[prog]
+[x]
+[extra]
+status: 0" argv remove:define extra / -DA --define=B x
+x "[prog]
+[--jobs=3]
+[file]
+status: 0" argv set:jobs=3 / file
+
+# incremental parsing
+printf -- '-vj2\nfile\n--jobs=3\n--\n-x\n' | x "option -v 
+retained: 0 args, 2 parsed
+option -j 2
+retained: 0 args, 2 parsed
+positional file
+retained: 1 args, 0 parsed
+option --jobs 3
+retained: 0 args, 1 parsed
+terminator
+retained: 0 args, 0 parsed
+positional -x
+retained: 1 args, 0 parsed
+jobs: 3
+[iterate]
+[--jobs=8]
+status: 0" iterate
+printf -- '-vj2\nfile\n--jobs=3\n--\n-x\n' | x "option -v 
+retained: 0 args, 2 parsed
+option -j 2
+retained: 0 args, 2 parsed
+positional file
+retained: 1 args, 2 parsed
+option --jobs 3
+retained: 1 args, 3 parsed
+terminator
+retained: 1 args, 3 parsed
+positional -x
+retained: 2 args, 3 parsed
+jobs: 3
+[iterate]
+[-v]
+[--jobs=8]
+[file]
+[--]
+[-x]
+status: 0" iterate keep
+
+# store_bool
+x "Usage: bool [options]
+
+Options:
+  -h, --help            show this help message and exit
+  -c, --color, --no-color
+                        colorize the output
+  --cache, --no-cache   reuse earlier results
+  --notes               print notes
+status: 0" bool -h
+x "color: 1
+cache: 
+notes: 
+status: 0" bool
+x "color: 0
+cache: 1
+notes: 
+status: 0" bool --no-color --cache
+x "color: 0
+cache: 0
+notes: 
+status: 0" bool --no-col --no-ca
+x "color: 0
+cache: 1
+notes: 
+status: 0" bool --color=0 --cache=1
+x "Usage: bool [options]
+
+bool: error: option --color: invalid value: 'yes'
+status: 3" bool --color=yes
+x "Usage: bool [options]
+
+bool: error: --no-color option does not take a value
+status: 3" bool --no-color=1
+x "Usage: bool [options]
+
+bool: error: ambiguous option: --no (--notes, --no-cache, --no-color?)
+status: 3" bool --no
+x "Usage: bool [options]
+
+bool: error: ambiguous option: --no-c (--no-cache, --no-color?)
+status: 3" bool --no-c
+x "Usage: bool [options]
+
+bool: error: ambiguous option: --c (--cache, --color?)
+status: 3" bool --c
+x "color: 1
+cache: 0
+notes: 
+status: 0" bool --colo --no-cache -c
+x "Usage: bool [options]
+
+bool: error: no such option: --no-colour, did you mean --no-color?
+status: 3" bool --no-colour
+
+# effective config
+x "{\"fast\":{\"value\":\"1\",\"source\":\"default\"},\"level\":{\"value\":\"3\",\"source\":\"default\"},\"jobs\":{\"value\":\"4\",\"source\":\"set_defaults\"},\"name\":{\"value\":null,\"source\":\"unset\"},\"define\":{\"value\":null,\"source\":\"unset\"},\"extra\":{\"value\":\"x\",\"source\":\"program\"}}
+status: 0" config
+TESTEXT_NAME=n x "{\"fast\":{\"value\":\"1\",\"source\":\"user\"},\"level\":{\"value\":\"2\",\"source\":\"user\"},\"jobs\":{\"value\":\"4\",\"source\":\"set_defaults\"},\"name\":{\"value\":\"n\",\"source\":\"environment\"},\"define\":{\"value\":[\"A\",\"B\"],\"source\":\"user\"},\"extra\":{\"value\":\"x\",\"source\":\"program\"}}
+status: 0" config --fast -l 2 -DA -DB
+x "{\"fast\":{\"value\":\"0\",\"source\":\"user\"},\"level\":{\"value\":\"3\",\"source\":\"default\"},\"jobs\":{\"value\":\"4\",\"source\":\"user\"},\"name\":{\"value\":null,\"source\":\"unset\"},\"define\":{\"value\":null,\"source\":\"unset\"},\"extra\":{\"value\":\"x\",\"source\":\"program\"}}
+status: 0" config --slow -j 4
+
+# snapshots
+x "size: 4
+dest 0: define='B' (user)
+dest 1: jobs='4' (user)
+dest 2: ratio='0.5' (user)
+dest 3: verbose='1' (user)
+jobs: 4 at 1
+ratio: 0.5
+verbose: true
+missing: npos
+define: A
+define: B
+torn reads: 0
+last published: yes
+status: 0" snapshot -j 4 -r 0.5 -DA -DB -v
+x "size: 1
+dest 0: jobs='1'
+jobs: 1 at 0
+ratio: 0
+verbose: false
+missing: npos
+torn reads: 0
+last published: yes
+status: 0" snapshot
+
+# tracing, only compiled in with make TRACE=1
+if [[ "$(./testext trace)" != "tracing disabled" ]] ; then
+x "registration: recorded
+tokenize: recorded
+lookup: recorded
+type_check: recorded
+callback: recorded
+defaults: recorded
+help: recorded
+records match counters: yes
+cleared: yes
+status: 0" trace
+echo "./testext trace json"
+./testext trace json | python -c 'import json, sys
+events = json.load(sys.stdin)["traceEvents"]
+assert events and all(e["ph"] == "X" and e["dur"] >= 0 for e in events)' || exit 1
+fi
+
+# choices
+x "arch: (unset) at npos
+level: mid at 1
+status: 0" choice
+x "arch: riscv at 3
+level: high at 2
+status: 0" choice --arch riscv -l high
+x "arch: arm at 1
+level: mid at 1
+status: 0" choice -a arm
+x "Usage: choice [options]
+
+choice: error: option -a: invalid choice: 'armm' (choose from 'x86', 'arm', 'arm', 'riscv'), did you mean 'arm'?
+status: 3" choice -a armm
+x "Usage: choice [options]
+
+choice: error: option -l: invalid choice: 'lo' (choose from 'low', 'mid', 'high'), did you mean 'low'?
+status: 3" choice -l lo
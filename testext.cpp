@@ -0,0 +1,490 @@
+/**
+ * Test program for features without a counterpart in Python's optparse,
+ * used by test.sh. The first argument selects a scenario, which parses
+ * the remaining arguments; its name becomes the program name.
+ */
+
+#include "OptionParser.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <atomic>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+using namespace optparse;
+
+//! Exits by throwing, so that scenarios can report how the parser exited
+class TestParser : public OptionParser {
+public:
+  void exit() const { throw 3; }
+};
+
+class BuildCommand : public SubcommandFactory {
+public:
+  void operator() (OptionParser& parser) {
+    parser.add_option("-j", "--jobs") .type("int") .set_default(1) .help("parallel jobs (default: %default)");
+    OptionGroup& group = parser.add_option_group("Output Options");
+    group.add_option("-o", "--output") .metavar("DIR") .help("output directory");
+  }
+};
+
+class CleanCommand : public SubcommandFactory {
+public:
+  void operator() (OptionParser& parser) {
+    parser.add_option("--all") .action("store_true") .help("remove everything");
+  }
+};
+
+static int subcommand(int argc, char* argv[]) {
+  BuildCommand build;
+  CleanCommand clean;
+  TestParser parser;
+  parser.add_option("-v", "--verbose") .action("store_true") .help("be verbose");
+  parser.add_subcommand("build", build, "Build the project.");
+  parser.add_subcommand("clean", clean, "Remove build results.");
+
+  Values& options = parser.parse_args(argc, argv);
+  cout << "verbose: " << (options.get("verbose") ? "true" : "false") << endl;
+  cout << "command: " << parser.subcommand() << endl;
+  OptionParser* sub = parser.subcommand_parser();
+  if (sub) {
+    Values& sub_options = sub->values();
+    if (parser.subcommand() == "build") {
+      cout << "jobs: " << (int) sub_options.get("jobs") << endl;
+      cout << "output: " << sub_options["output"] << endl;
+    } else
+      cout << "all: " << (sub_options.get("all") ? "true" : "false") << endl;
+    vector<string> args = sub->args();
+    for (vector<string>::const_iterator it = args.begin(); it != args.end(); ++it)
+      cout << "arg: " << *it << endl;
+  }
+  return 0;
+}
+
+static int bind(int argc, char* argv[]) {
+  int i = 0;
+  unsigned long u = 0;
+  long long ll = 0;
+  float f = 0;
+  bool b = false;
+  TestParser parser;
+  parser.add_option("--int") .bind(&i);
+  parser.add_option("--unsigned") .bind(&u);
+  parser.add_option("--long-long") .bind(&ll);
+  parser.add_option("--float") .bind(&f);
+  parser.add_option("--bool") .bind(&b);
+
+  parser.parse_args(argc, argv);
+  cout << "int: " << i << endl;
+  cout << "unsigned: " << u << endl;
+  cout << "long-long: " << ll << endl;
+  cout << "float: " << f << endl;
+  cout << "bool: " << (b ? "true" : "false") << endl;
+  return 0;
+}
+
+static const char* source(const Values& options, const string& dest) {
+  if (options.is_set_by_user(dest))
+    return "user";
+  if (options.is_set_from_env(dest))
+    return "environment";
+  return options.is_set(dest) ? "default" : "unset";
+}
+
+static int env(int argc, char* argv[]) {
+  TestParser parser;
+  parser.add_option("-w", "--width") .type("int") .set_default(80) .env("TESTEXT_WIDTH");
+  parser.add_option("--fast") .action("store_true") .env("TESTEXT_FAST");
+  parser.add_option("--name") .env("TESTEXT_NAME");
+  parser.add_option("--color") .action("store_bool") .set_default("1") .env("TESTEXT_COLOR");
+
+  Values& options = parser.parse_args(argc, argv);
+  cout << "width: " << (int) options.get("width") << " (" << source(options, "width") << ")" << endl;
+  cout << "fast: " << (options.get("fast") ? "true" : "false") << " (" << source(options, "fast") << ")" << endl;
+  cout << "name: " << options["name"] << " (" << source(options, "name") << ")" << endl;
+  cout << "color: " << options["color"] << " (" << source(options, "color") << ")" << endl;
+  return 0;
+}
+
+static string value(const Values& values, const string& dest) {
+  optional<const string*> v = values[dest];
+  return v ? **v : "(unset)";
+}
+
+class PrintChange : public ChangeCallback {
+public:
+  void operator() (const string& dest, const Values& old, const Values& values, const OptionParser& /* parser */) {
+    cout << "changed " << dest << ": " << value(old, dest) << " -> " << value(values, dest) << endl;
+  }
+};
+
+//! Parses the arguments up to "/", then reparses the rest
+static int reparse(int argc, char* argv[]) {
+  int width = 0;
+  PrintChange print;
+  TestParser parser;
+  parser.add_option("-w", "--width") .type("int") .bind(&width) .on_change(print);
+  parser.add_option("-m", "--mode") .on_change(print);
+
+  int split = 1;
+  while (split < argc and string(argv[split]) != "/")
+    ++split;
+  parser.parse_args(split, argv);
+  vector<string> args(argv + min(split + 1, argc), argv + argc);
+
+  int status = 0;
+  try {
+    set<string> changed = parser.reparse(args);
+    for (set<string>::const_iterator it = changed.begin(); it != changed.end(); ++it)
+      cout << "dest: " << *it << endl;
+  }
+  catch(int ex) {
+    status = ex;
+  }
+  const Values& options = parser.values();
+  cout << "width: " << value(options, "width") << ", bound: " << width << endl;
+  cout << "mode: " << value(options, "mode") << endl;
+  return status;
+}
+
+//! Rejects the value "bad" through error(), which must not exit on a worker thread
+class Check : public Callback {
+public:
+  void operator() (const Option& /* option */, const string& opt, const string& val, const OptionParser& parser) {
+    if (val == "bad")
+      parser.error("option " + opt + ": check failed for '" + val + "'");
+  }
+};
+
+//! Parses the words of the value with a parser of its own, which must still exit on errors
+class Load : public Callback {
+public:
+  void operator() (const Option& /* option */, const string& opt, const string& val, const OptionParser& parser) {
+    TestParser inner;
+    inner.prog("load");
+    inner.add_option("--lvl") .type("int");
+    vector<string> args;
+    istringstream words(val);
+    for (string w; words >> w; )
+      args.push_back(w);
+    try {
+      Values& options = inner.parse_args(args);
+      cout << "loaded lvl: " << options["lvl"] << endl;
+    }
+    catch(int) {
+      parser.error("option " + opt + ": cannot load '" + val + "'");
+    }
+  }
+};
+
+static int defer(int argc, char* argv[]) {
+  Check check;
+  Load load;
+  TestParser parser;
+  parser.callback_threads(4);
+  parser.add_option("-c", "--check") .action("callback") .type("string") .callback(check) .defer();
+  parser.add_option("--load") .action("callback") .type("string") .callback(load) .defer();
+
+  parser.parse_args(argc, argv);
+  cout << "all checks passed" << endl;
+  return 0;
+}
+
+// registered options are only collected by ELF linkers
+#if defined(OPTPARSE_REGISTER)
+OPTPARSE_REGISTER(zoom, OptionDescriptor("--zoom") .type("int") .set_default("100") .help("zoom level") .group("Display"));
+OPTPARSE_REGISTER(retries, OptionDescriptor("-r", "--retries") .type("int") .help("retry count"));
+OPTPARSE_REGISTER(proxy, OptionDescriptor("--proxy") .metavar("URL") .help("proxy server") .group("Network"));
+OPTPARSE_REGISTER(alpha, OptionDescriptor("--alpha") .action("store_true") .help("blend layers") .group("Display"));
+OPTPARSE_REGISTER(dump, OptionDescriptor("--dump") .action("store_true") .dest("dump_config") .help("print the configuration"));
+
+static int registry(int argc, char* argv[]) {
+  TestParser parser;
+  parser.add_registered_options();
+
+  Values& options = parser.parse_args(argc, argv);
+  cout << "zoom: " << options["zoom"] << endl;
+  cout << "retries: " << options["retries"] << endl;
+  cout << "proxy: " << options["proxy"] << endl;
+  cout << "alpha: " << (options.get("alpha") ? "true" : "false") << endl;
+  cout << "dump_config: " << (options.get("dump_config") ? "true" : "false") << endl;
+  return 0;
+}
+#endif
+
+//! Applies edits like "set:jobs=4", "remove:verbose" or "append:define=X" up to "/"
+//! to the arguments after it, printing the built argv one argument per line
+static int argv_builder(int argc, char* argv[]) {
+  int split = 1;
+  while (split < argc and string(argv[split]) != "/")
+    ++split;
+
+  TestParser parser;
+  parser.add_option("-v", "--verbose") .action("store_true");
+  parser.add_option("-q", "--quiet") .action("store_false") .dest("verbose");
+  parser.add_option("-j", "--jobs") .type("int");
+  parser.add_option("-D", "--define") .action("append");
+  parser.add_option("-k") .action("store_true") .dest("keep_going");
+  vector<const char*> args(1, argv[0]);
+  args.insert(args.end(), argv + min(split + 1, argc), argv + argc);
+  parser.parse_args(static_cast<int>(args.size()), &args[0]);
+
+  ArgvBuilder builder(parser);
+  builder.program("prog");
+  for (int i = 1; i < split; ++i) {
+    const string edit = argv[i];
+    const size_t colon = edit.find(':'), eq = edit.find('=');
+    const string op = edit.substr(0, colon);
+    const string dest = edit.substr(colon + 1, eq == string::npos ? string::npos : eq - colon - 1);
+    const string value = eq == string::npos ? "" : edit.substr(eq + 1);
+    if (op == "set")
+      builder.set(dest, value);
+    else if (op == "remove")
+      builder.remove(dest);
+    else if (op == "append")
+      builder.append(dest, value);
+    else
+      builder.append_arg(edit);
+  }
+  char* const* built = builder.build();
+  for (size_t i = 0; i < builder.size(); ++i)
+    cout << "[" << built[i] << "]" << endl;
+  return built[builder.size()] == 0 ? 0 : 1;
+}
+
+//! Parses one argument per line of stdin, keeping them for ArgvBuilder if the argument is "keep"
+static int iterate(int argc, char* argv[]) {
+  const bool keep = argc > 1 and string(argv[1]) == "keep";
+  TestParser parser;
+  parser.prog(argv[0]);
+  parser.add_option("-v", "--verbose") .action("store_true");
+  parser.add_option("-j", "--jobs") .type("int");
+
+  StreamArgSource source(cin);
+  ParseIterator it = parser.iterate(source, keep);
+  ParseEvent e;
+  while (it.next(e)) {
+    if (e.kind == ParseEvent::OPTION)
+      cout << "option " << e.opt << " " << e.value << endl;
+    else if (e.kind == ParseEvent::POSITIONAL)
+      cout << "positional " << e.value << endl;
+    else
+      cout << "terminator" << endl;
+    cout << "retained: " << parser.args().size() << " args, " << parser.parsed_args().size() << " parsed" << endl;
+  }
+  cout << "jobs: " << parser.values()["jobs"] << endl;
+
+  ArgvBuilder builder(parser);
+  builder.program(argv[0]).set("jobs", "8");
+  char* const* built = builder.build();
+  for (size_t i = 0; i < builder.size(); ++i)
+    cout << "[" << built[i] << "]" << endl;
+  return 0;
+}
+
+static int store_bool(int argc, char* argv[]) {
+  TestParser parser;
+  parser.add_option("-c", "--color") .action("store_bool") .set_default("1") .help("colorize the output");
+  parser.add_option("--cache") .action("store_bool") .help("reuse earlier results");
+  parser.add_option("--notes") .action("store_true") .help("print notes");
+
+  Values& options = parser.parse_args(argc, argv);
+  cout << "color: " << options["color"] << endl;
+  cout << "cache: " << options["cache"] << endl;
+  cout << "notes: " << options["notes"] << endl;
+  return 0;
+}
+
+static int config(int argc, char* argv[]) {
+  TestParser parser;
+  parser.add_option("--fast") .action("store_true");
+  parser.add_option("--slow") .action("store_false") .dest("fast") .set_default("1");
+  parser.add_option("-l", "--level") .type("int") .set_default(3);
+  parser.add_option("-j", "--jobs") .type("int") .set_default(1);
+  parser.add_option("-n", "--name") .env("TESTEXT_NAME");
+  parser.add_option("-D", "--define") .action("append");
+  parser.set_defaults("jobs", 4);
+
+  Values& options = parser.parse_args(argc, argv);
+  options["extra"] = "x";
+  string out;
+  EffectiveConfig(parser).write_json(out);
+  cout << out << endl;
+  return 0;
+}
+
+static int snapshot(int argc, char* argv[]) {
+  TestParser parser;
+  parser.add_option("-j", "--jobs") .type("int") .set_default(1);
+  parser.add_option("-r", "--ratio") .type("float");
+  parser.add_option("-D", "--define") .action("append");
+  parser.add_option("-v", "--verbose") .action("store_true");
+
+  Values& options = parser.parse_args(argc, argv);
+  const Snapshot snap(options);
+  cout << "size: " << snap.size() << endl;
+  for (size_t i = 0; i < snap.size(); ++i)
+    cout << "dest " << i << ": " << snap.dest(i) << "='" << snap.get(i) << "'"
+         << (snap.is_set_by_user(i) ? " (user)" : "") << endl;
+  cout << "jobs: " << snap.get_int("jobs") << " at " << snap.index("jobs") << endl;
+  cout << "ratio: " << snap.get_float("ratio") << endl;
+  cout << "verbose: " << (snap.get_bool("verbose") ? "true" : "false") << endl;
+  cout << "missing: " << (snap.index("missing") == Snapshot::npos ? "npos" : "found") << endl;
+  const vector<string>& all = snap.all("define");
+  for (vector<string>::const_iterator it = all.begin(); it != all.end(); ++it)
+    cout << "define: " << *it << endl;
+
+  // readers must always see a snapshot whose two dests were published together
+  SnapshotCell cell;
+  Values v;
+  v["gen"] = "0";
+  v["copy"] = "0";
+  cell.publish(v);
+  atomic<bool> stop(false);
+  atomic<unsigned long> torn(0), reads(0);
+  vector<thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.push_back(thread([&]() {
+      long long last = 0;
+      while (not stop.load()) {
+        SnapshotCell::Reader r = cell.read();
+        long long gen = r->get_int("gen");
+        if (gen != r->get_int("copy") or gen < last)
+          ++torn;
+        last = gen;
+        ++reads;
+      }
+    }));
+  }
+  int gen = 0;
+  while (gen < 2000 or reads.load() < 1000) {
+    ++gen;
+    v["gen"] = to_string(gen);
+    v["copy"] = to_string(gen);
+    cell.publish(v);
+  }
+  stop = true;
+  for (size_t t = 0; t < readers.size(); ++t)
+    readers[t].join();
+  cout << "torn reads: " << torn.load() << endl;
+  cout << "last published: " << (cell.read()->get_int("gen") == gen ? "yes" : "no") << endl;
+  return 0;
+}
+
+class Ignore : public Callback {
+public:
+  void operator() (const Option&, const string&, const string&, const OptionParser&) {}
+};
+
+//! Parses a fixed command line with tracing and checks the counters, or prints
+//! the Chrome trace if the argument is "json"; needs a build with TRACE=1
+static int tracing(int argc, char* argv[]) {
+#if defined(OPTPARSE_TRACE) && OPTPARSE_TRACE
+  trace::clear();
+  Ignore ignore;
+  TestParser parser;
+  parser.add_option("-j", "--jobs") .type("int") .set_default(1);
+  parser.add_option("--hook") .action("callback") .callback(ignore);
+  OptionGroup& group = parser.add_option_group("Output Options");
+  group.add_option("-o", "--output");
+  const char* args[] = { "trace", "-j", "2", "--hook", "--output=out" };
+  parser.parse_args(5, args);
+  parser.format_help();
+
+  if (argc > 1 and string(argv[1]) == "json") {
+    trace::write_chrome_trace(cout);
+    return 0;
+  }
+  uint64_t total = 0;
+  for (int p = 0; p < trace::NUM_PHASES; ++p) {
+    trace::Counter c = trace::counter(static_cast<trace::Phase>(p));
+    cout << trace::phase_name(static_cast<trace::Phase>(p)) << ": "
+         << ((c.count != 0 and c.total_ns != 0) ? "recorded" : "missing") << endl;
+    total += c.count;
+  }
+  vector<trace::Record> records(trace::RING_SIZE);
+  size_t n = trace::records(&records[0], records.size());
+  cout << "records match counters: " << (n == total ? "yes" : "no") << endl;
+  trace::clear();
+  cout << "cleared: " << (trace::records(&records[0], records.size()) == 0 ? "yes" : "no") << endl;
+  return 0;
+#else
+  (void) argc;
+  (void) argv;
+  cout << "tracing disabled" << endl;
+  return 0;
+#endif
+}
+
+static void print_choice(const Values& options, const string& dest) {
+  size_t i = options.choice(dest);
+  cout << dest << ": " << value(options, dest) << " at ";
+  if (i == Values::npos)
+    cout << "npos" << endl;
+  else
+    cout << i << endl;
+}
+
+static int choice(int argc, char* argv[]) {
+  TestParser parser;
+  parser.add_option("-a", "--arch") .choices({"x86", "arm", "arm", "riscv"});
+  parser.add_option("-l", "--level") .choices({"low", "mid", "high"}) .set_default("mid");
+
+  const Values& options = parser.parse_args(argc, argv);
+  print_choice(options, "arch");
+  print_choice(options, "level");
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    cerr << "usage: testext SCENARIO [ARG]..." << endl;
+    return 2;
+  }
+  const string scenario = argv[1];
+
+  try {
+    if (scenario == "subcommand")
+      return subcommand(argc - 1, argv + 1);
+    if (scenario == "bind")
+      return bind(argc - 1, argv + 1);
+    if (scenario == "env")
+      return env(argc - 1, argv + 1);
+    if (scenario == "reparse")
+      return reparse(argc - 1, argv + 1);
+    if (scenario == "defer")
+      return defer(argc - 1, argv + 1);
+#if defined(OPTPARSE_REGISTER)
+    if (scenario == "registry")
+      return registry(argc - 1, argv + 1);
+#endif
+    if (scenario == "argv")
+      return argv_builder(argc - 1, argv + 1);
+    if (scenario == "iterate")
+      return iterate(argc - 1, argv + 1);
+    if (scenario == "bool")
+      return store_bool(argc - 1, argv + 1);
+    if (scenario == "config")
+      return config(argc - 1, argv + 1);
+    if (scenario == "snapshot")
+      return snapshot(argc - 1, argv + 1);
+    if (scenario == "trace")
+      return tracing(argc - 1, argv + 1);
+    if (scenario == "choice")
+      return choice(argc - 1, argv + 1);
+  }
+  catch(int ex) {
+    return ex;
+  }
+
+  cerr << "testext: unknown scenario " << scenario << endl;
+  return 2;
+}